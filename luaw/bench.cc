@@ -0,0 +1,250 @@
+#include "luaw.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace std::string_literals;
+
+#if LUAW == JIT
+static const char* backend = "jit";
+#else
+static const char* backend = "54";
+#endif
+
+// Each benchmark prints one JSON object per line:
+//   {"backend":"54","case":"push/vector<int>","size":1000,"iterations":2048,"ns_per_op":1234.5}
+// so results from different runs/backends can be diffed or loaded by any tool.
+
+static const char* filter = nullptr;
+static volatile size_t sink = 0;
+
+static void bench(std::string const& name, size_t size, auto fn)
+{
+    if (filter && !strstr(name.c_str(), filter))
+        return;
+
+    using clock = std::chrono::steady_clock;
+    const auto min_time = std::chrono::milliseconds(100);
+
+    fn();  // warmup
+
+    size_t iterations = 1;
+    clock::duration elapsed;
+    for (;;) {
+        auto start = clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            fn();
+        elapsed = clock::now() - start;
+        if (elapsed >= min_time || iterations >= (1u << 30))
+            break;
+        iterations *= 2;
+    }
+
+    double ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    printf("{\"backend\":\"%s\",\"case\":\"%s\",\"size\":%zu,\"iterations\":%zu,\"ns_per_op\":%.1f}\n",
+           backend, name.c_str(), size, iterations, ns / (double) iterations);
+    fflush(stdout);
+}
+
+struct Point {
+    int x, y;
+
+    void to_lua(lua_State* L) const {
+        lua_newtable(L);
+        luaw_setfield(L, -1, "x", x);
+        luaw_setfield(L, -1, "y", y);
+    }
+
+    static Point from_lua(lua_State* L, int index) {
+        return {
+            .x = luaw_getfield<int>(L, index, "x"),
+            .y = luaw_getfield<int>(L, index, "y"),
+        };
+    }
+
+    static bool lua_is(lua_State* L, int index) {
+        return luaw_hasfield(L, index, "x") && luaw_hasfield(L, index, "y");
+    }
+};
+
+struct ReflectedPoint {
+    int x, y;
+
+    static constexpr auto lua_fields = std::make_tuple(LUAW_FIELD(ReflectedPoint, x), LUAW_FIELD(ReflectedPoint, y));
+};
+
+// push a value and pop it back, measuring the full round trip
+template <typename T>
+static void bench_roundtrip(lua_State* L, std::string const& name, size_t size, T const& value)
+{
+    bench("push/"s + name, size, [&] {
+        luaw_push(L, value);
+        lua_pop(L, 1);
+    });
+
+    luaw_push(L, value);
+    bench("is/"s + name, size, [&] { sink = sink + luaw_is<T>(L, -1); });
+    bench("to/"s + name, size, [&] { T t = luaw_to<T>(L, -1); sink = sink + sizeof t; });
+    lua_pop(L, 1);
+
+    bench("roundtrip/"s + name, size, [&] {
+        luaw_push(L, value);
+        T t = luaw_to<T>(L, -1);   // same as luaw_pop, which doesn't accept views
+        lua_pop(L, 1);
+        sink = sink + sizeof t;
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+
+    lua_State* L = luaw_newstate();
+
+    const size_t sizes[] = { 1, 10, 100, 1000, 10000 };
+
+    // scalars
+
+    bench_roundtrip(L, "int", 1, 42);
+    bench_roundtrip(L, "double", 1, 42.8);
+    bench_roundtrip(L, "bool", 1, true);
+    for (size_t n : { 16, 1024, 65536 }) {
+        std::string str(n, 'x');
+        bench_roundtrip(L, "string", n, str);
+        bench_roundtrip(L, "string_view", n, std::string_view(str));
+    }
+    bench_roundtrip(L, "optional<int>", 1, std::optional<int>(42));
+    bench_roundtrip(L, "optional<int>/empty", 1, std::optional<int>());
+    bench_roundtrip(L, "tuple<bool,int,string>", 3, std::tuple<bool, int, std::string>(false, 48, "str"));
+    bench_roundtrip(L, "struct/Point", 2, Point { 3, 4 });
+    bench_roundtrip(L, "struct/ReflectedPoint", 2, ReflectedPoint { 3, 4 });
+
+    // containers
+
+    for (size_t n : sizes) {
+        std::vector<int> vi(n);
+        std::vector<double> vd(n);
+        std::vector<std::string> vs(n);
+        std::map<std::string, int> mp;
+        for (size_t i = 0; i < n; ++i) {
+            vi[i] = (int) i;
+            vd[i] = (double) i * 0.5;
+            vs[i] = "item" + std::to_string(i);
+            mp["key" + std::to_string(i)] = (int) i;
+        }
+
+        bench_roundtrip(L, "vector<int>", n, vi);
+        bench_roundtrip(L, "vector<double>", n, vd);
+        bench_roundtrip(L, "vector<string>", n, vs);
+        bench("push/span<double>", n, [&] { luaw_push(L, std::span<const double>(vd)); lua_pop(L, 1); });
+        bench_roundtrip(L, "map<string,int>", n, mp);
+
+        std::map<std::string, std::vector<int>> nested;
+        for (size_t i = 0; i < n; ++i)
+            nested["key" + std::to_string(i)] = std::vector<int>(10, (int) i);
+        bench_roundtrip(L, "map<string,vector<int>>", n, nested);
+        luaw_push(L, nested);
+        bench("try_to/map<string,vector<int>>", n, [&] { sink = sink + luaw_try_to<decltype(nested)>(L, -1)->size(); });
+        lua_pop(L, 1);
+    }
+
+    // fields
+
+    luaw_do(L, "return { a = { b = { c = 84 } }, x = 1 }", 1);
+
+    bench("getfield/depth1", 1, [&] { sink = sink + luaw_getfield<int>(L, -1, "x"); });
+    bench("getfield/depth3", 3, [&] { sink = sink + luaw_getfield<int>(L, -1, "a.b.c"); });
+    bench("hasfield/depth3", 3, [&] { sink = sink + luaw_hasfield(L, -1, "a.b.c"); });
+    bench("setfield/depth1", 1, [&] { luaw_setfield(L, -1, "x", 2); });
+    bench("setfield/depth3", 3, [&] { luaw_setfield(L, -1, "a.b.c", 85); });
+
+    LuaFieldPath path1("x"), path3("a.b.c");
+    static constexpr LuaStaticFieldPath spath3("a.b.c");
+    bench("getfield/path/depth1", 1, [&] { sink = sink + luaw_getfield<int>(L, -1, path1); });
+    bench("getfield/path/depth3", 3, [&] { sink = sink + luaw_getfield<int>(L, -1, path3); });
+    bench("getfield/static_path/depth3", 3, [&] { sink = sink + luaw_getfield<int>(L, -1, spath3); });
+    bench("hasfield/path/depth3", 3, [&] { sink = sink + luaw_hasfield(L, -1, path3); });
+    bench("setfield/path/depth3", 3, [&] { luaw_setfield(L, -1, path3, 85); });
+
+    lua_pop(L, 1);
+
+    // calls
+
+    luaw_do(L, "function bench_noop() end");
+    luaw_do(L, "function bench_add(a, b) return a + b end");
+    luaw_do(L, "function bench_sum(t) local s = 0; for i = 1, #t do s = s + t[i] end; return s end");
+
+    bench("call_global/noop", 0, [&] { luaw_call_global(L, "bench_noop"); });
+    bench("call_global/add", 2, [&] { sink = sink + luaw_call_global<int>(L, "bench_add", 20, 22); });
+
+    LuaFunction<void()> noop_fn(L, "bench_noop");
+    LuaFunction<int(int, int)> add_fn(L, "bench_add");
+    bench("call_handle/noop", 0, [&] { noop_fn(); });
+    bench("call_handle/add", 2, [&] { sink = sink + add_fn(20, 22); });
+
+    for (size_t n : sizes) {
+        std::vector<double> vd(n, 1.0);
+        bench("call_global/sum", n, [&] { sink = sink + (size_t) luaw_call_global<double>(L, "bench_sum", vd); });
+    }
+
+    // code loading
+
+    bench("do/return_table", 1, [&] { luaw_do(L, "return { 1, 2, 3 }", 1); lua_pop(L, 1); });
+
+    LuaChunk chunk(L, "return { 1, 2, 3 }");
+    bench("chunk/return_table", 1, [&] { chunk.run(1); lua_pop(L, 1); });
+
+    luaw_set_chunk_cache(L, 16);
+    bench("do/cached/return_table", 1, [&] { luaw_do(L, "return { 1, 2, 3 }", 1); lua_pop(L, 1); });
+    luaw_set_chunk_cache(L, 0);
+
+    // parallel compilation
+
+    std::vector<LuaSource> sources;
+    for (int i = 0; i < 64; ++i) {
+        std::string code;
+        for (int j = 0; j < 200; ++j)
+            code += "function bench_f" + std::to_string(i) + "_" + std::to_string(j) + "(a, b) local t = { a, b, a * b } return t[1] + t[2] + t[3] end\n";
+        sources.push_back({ .code = code, .name = "bench_" + std::to_string(i) });
+    }
+    bench("do/sequential/64_sources", sources.size(), [&] { for (auto const& src : sources) luaw_do(L, src.code, 0, src.name); });
+    bench("do/parallel/64_sources", sources.size(), [&] { luaw_do_parallel(L, sources); });
+
+    // execution budget (overhead of the count hook)
+
+    luaw_do(L, "function bench_loop() local s = 0 for i = 1, 10000 do s = s + i end return s end");
+    bench("budget/loop/none", 10000, [&] { sink = sink + luaw_call_global<int>(L, "bench_loop"); });
+    {
+        LuaBudgetGuard guard(L, { .instructions = SIZE_MAX });
+        bench("budget/loop/instructions", 10000, [&] { sink = sink + luaw_call_global<int>(L, "bench_loop"); });
+    }
+    {
+        LuaBudgetGuard guard(L, { .time = std::chrono::hours(1) });
+        bench("budget/loop/time", 10000, [&] { sink = sink + luaw_call_global<int>(L, "bench_loop"); });
+    }
+    {
+        LuaProfiler profiler(L, { .interval = std::chrono::milliseconds(10) });
+        bench("profiler/loop/10ms", 10000, [&] { sink = sink + luaw_call_global<int>(L, "bench_loop"); });
+    }
+
+    // allocator
+
+    const char* churn = "local t = {} for i = 1, 100 do t[i] = { i, tostring(i) } end";
+    bench("alloc/churn/default", 100, [&] { luaw_do(L, churn); });
+    lua_State* P = luaw_newstate({ .pool_allocator = true });
+    bench("alloc/churn/pool", 100, [&] { luaw_do(P, churn); });
+    luaw_close(P);
+
+    luaw_ensure(L);
+    lua_close(L);
+}
@@ -1,101 +1,1390 @@
 #include "luaw.hh"
 
-#include <fstream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <functional>
+#include <list>
+#include <memory>
+#include <new>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 
 #include <tgmath.h>
 #include <zlib.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace std::string_literals;
 
-extern "C" {
-#if LUAW == JIT
-# include "../luajit/src/lua.hpp"
-#else
-# include "lua.hpp"
-#endif
+extern "C" {
+#if LUAW == JIT
+# include "../luajit/src/lua.hpp"
+#else
+# include "lua.hpp"
+#endif
+}
+
+//
+// STRICT MODE
+//
+
+// Globals must be declared (assigned) in the main chunk or from C before they're used. The list of declared
+// globals is kept in the `__declared` field of the metatable of `_G`, shared by `__index` and `__newindex`.
+
+static const char* caller_what(lua_State* L)
+{
+    lua_Debug ar;
+    if (!lua_getstack(L, 1, &ar))   // called directly from the C API
+        return "C";
+    lua_getinfo(L, "S", &ar);
+    return ar.what;
+}
+
+static bool strict_declared(lua_State* L)
+{
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    bool declared = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return declared;
+}
+
+static int strict_newindex(lua_State* L)   // t, n, v
+{
+    if (!strict_declared(L)) {
+        const char* what = caller_what(L);
+        if (strcmp(what, "main") != 0 && strcmp(what, "C") != 0)
+            luaL_error(L, "assign to undeclared variable '%s'", lua_isstring(L, 2) ? lua_tostring(L, 2) : "?");
+        lua_pushvalue(L, 2);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, lua_upvalueindex(1));
+    }
+    lua_rawset(L, 1);
+    return 0;
+}
+
+static int strict_index(lua_State* L)   // t, n
+{
+    if (!strict_declared(L) && strcmp(caller_what(L), "C") != 0)
+        luaL_error(L, "variable '%s' is not declared", lua_isstring(L, 2) ? lua_tostring(L, 2) : "?");
+    lua_rawget(L, 1);
+    return 1;
+}
+
+static void setup_strict(lua_State* L)
+{
+    luaw_push_globals(L);
+    if (!lua_getmetatable(L, -1)) {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setmetatable(L, -3);
+    }
+
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "__declared");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, strict_newindex, 1);
+    lua_setfield(L, -3, "__newindex");
+    lua_pushcclosure(L, strict_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 2);
+}
+
+// Static check: find the globals used by a chunk without loading it. The scopes of local variables are tracked
+// approximately (e.g. in `local x = x`, the second `x` is considered local) - the runtime checks still apply,
+// unless the chunk is run with `luaw_do_checked`.
+
+namespace {
+
+struct LuaToken {
+    enum Type { Name, Keyword, Symbol, Literal, End } type;
+    std::string_view text;
+    int              line;
+};
+
+class LuaLexer {
+public:
+    explicit LuaLexer(std::string_view code) : code_(code) {}
+
+    LuaToken next();
+
+private:
+    bool skip_long_bracket();   // at '[', skip `[==[ ... ]==]` if it's a long bracket
+
+    std::string_view code_;
+    size_t           pos_ = 0;
+    int              line_ = 1;
+};
+
+bool LuaLexer::skip_long_bracket()
+{
+    size_t p = pos_ + 1;
+    size_t level = 0;
+    while (p < code_.size() && code_[p] == '=') { ++p; ++level; }
+    if (p >= code_.size() || code_[p] != '[')
+        return false;
+
+    std::string close = "]" + std::string(level, '=') + "]";
+    size_t end = code_.find(close, p + 1);
+    end = (end == std::string_view::npos) ? code_.size() : end + close.size();
+    for (size_t j = pos_; j < end; ++j)
+        line_ += code_[j] == '\n';
+    pos_ = end;
+    return true;
+}
+
+LuaToken LuaLexer::next()
+{
+    static constexpr std::string_view keywords[] = {
+        "and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in", "local",
+        "nil", "not", "or", "repeat", "return", "then", "true", "until", "while",
+    };
+    static constexpr std::string_view symbols[] = { "...", "..", "==", "~=", "<=", ">=", "::", "//", "<<", ">>" };
+
+    for (;;) {
+        if (pos_ >= code_.size())
+            return { LuaToken::End, {}, line_ };
+
+        char c = code_[pos_];
+        if (c == '\n') {
+            ++line_;
+            ++pos_;
+        } else if (isspace((unsigned char) c)) {
+            ++pos_;
+        } else if (code_.substr(pos_, 2) == "--") {
+            pos_ += 2;
+            if (pos_ >= code_.size() || code_[pos_] != '[' || !skip_long_bracket())
+                while (pos_ < code_.size() && code_[pos_] != '\n')
+                    ++pos_;
+        } else if (c == '#' && pos_ == 0) {   // shebang
+            while (pos_ < code_.size() && code_[pos_] != '\n')
+                ++pos_;
+        } else {
+            break;
+        }
+    }
+
+    size_t start = pos_;
+    int line = line_;
+    char c = code_[pos_];
+
+    if (isalpha((unsigned char) c) || c == '_') {
+        while (pos_ < code_.size() && (isalnum((unsigned char) code_[pos_]) || code_[pos_] == '_'))
+            ++pos_;
+        std::string_view word = code_.substr(start, pos_ - start);
+        bool keyword = std::find(std::begin(keywords), std::end(keywords), word) != std::end(keywords);
+        return { keyword ? LuaToken::Keyword : LuaToken::Name, word, line };
+    }
+
+    if (isdigit((unsigned char) c) || (c == '.' && pos_ + 1 < code_.size() && isdigit((unsigned char) code_[pos_ + 1]))) {
+        while (pos_ < code_.size() && (isalnum((unsigned char) code_[pos_]) || code_[pos_] == '.'
+                    || ((code_[pos_] == '+' || code_[pos_] == '-') && strchr("eEpP", code_[pos_ - 1]))))
+            ++pos_;
+        return { LuaToken::Literal, code_.substr(start, pos_ - start), line };
+    }
+
+    if (c == '"' || c == '\'') {
+        ++pos_;
+        while (pos_ < code_.size() && code_[pos_] != c) {
+            if (code_[pos_] == '\\' && pos_ + 1 < code_.size())
+                ++pos_;
+            line_ += code_[pos_] == '\n';
+            ++pos_;
+        }
+        ++pos_;
+        return { LuaToken::Literal, code_.substr(start, std::min(pos_, code_.size()) - start), line };
+    }
+
+    if (c == '[' && skip_long_bracket())
+        return { LuaToken::Literal, code_.substr(start, pos_ - start), line };
+
+    for (std::string_view sym : symbols) {
+        if (code_.substr(pos_, sym.size()) == sym) {
+            pos_ += sym.size();
+            return { LuaToken::Symbol, sym, line };
+        }
+    }
+    ++pos_;
+    return { LuaToken::Symbol, code_.substr(start, 1), line };
+}
+
+struct GlobalUse {
+    std::string name;
+    int         line;
+    bool        assigned;
+    bool        in_function;
+};
+
+std::vector<GlobalUse> find_globals(std::string_view code)
+{
+    std::vector<LuaToken> tokens;
+    LuaLexer lexer(code);
+    for (LuaToken t = lexer.next(); t.type != LuaToken::End; t = lexer.next())
+        tokens.push_back(t);
+    tokens.push_back({ LuaToken::End, {}, 0 });
+
+    enum class Block { Function, For, Other };
+    struct Scope {
+        Block                         block;
+        std::vector<std::string_view> locals;
+        bool                          waiting_do = false;   // `for` header, the `do` doesn't open a new block
+        size_t                        brackets = 0;         // brackets open when a function body starts
+    };
+    std::vector<Scope> scopes { { Block::Other, {}, false, 0 } };
+    std::vector<char> brackets;   // open '(', '[', '{'
+    std::vector<GlobalUse> uses;
+
+    auto is = [&](size_t i, std::string_view text) { return tokens[i].type != LuaToken::Literal && tokens[i].text == text; };
+    auto is_local = [&](std::string_view name) {
+        for (auto const& scope : scopes)
+            if (std::find(scope.locals.begin(), scope.locals.end(), name) != scope.locals.end())
+                return true;
+        return false;
+    };
+    auto in_function = [&] {
+        return std::any_of(scopes.begin(), scopes.end(), [](Scope const& sc) { return sc.block == Block::Function; });
+    };
+    auto declare_params = [&](size_t i) {   // at '(' of a parameter list, returns the index after ')'
+        for (++i; tokens[i].type != LuaToken::End && !is(i, ")"); ++i)
+            if (tokens[i].type == LuaToken::Name)
+                scopes.back().locals.push_back(tokens[i].text);
+        return i + 1;
+    };
+    auto statement_level = [&] {   // not inside brackets, in the current function
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+            if (it->block == Block::Function)
+                return brackets.size() == it->brackets;
+        return brackets.empty();
+    };
+    auto pop_scope = [&] {
+        if (scopes.size() > 1)
+            scopes.pop_back();
+    };
+
+    for (size_t i = 0; tokens[i].type != LuaToken::End; ) {
+        LuaToken const& t = tokens[i];
+
+        if (t.type == LuaToken::Keyword) {
+            if (t.text == "local" && is(i + 1, "function")) {
+                scopes.back().locals.push_back(tokens[i + 2].text);
+                scopes.push_back({ Block::Function, {}, false, brackets.size() });
+                i = declare_params(i + 3);
+                continue;
+            } else if (t.text == "local") {
+                for (++i; tokens[i].type == LuaToken::Name; ) {
+                    scopes.back().locals.push_back(tokens[i++].text);
+                    if (is(i, "<"))   // attribute
+                        i += 3;
+                    if (!is(i, ","))
+                        break;
+                    ++i;
+                }
+                continue;
+            } else if (t.text == "function") {
+                size_t j = i + 1;
+                bool method = false;
+                if (tokens[j].type == LuaToken::Name) {   // function statement: `function a.b:c()` uses `a`
+                    std::string_view name = tokens[j].text;
+                    bool plain = !is(j + 1, ".") && !is(j + 1, ":");
+                    if (!is_local(name))
+                        uses.push_back({ std::string(name), t.line, plain, in_function() });
+                    while (!is(j, "(") && tokens[j].type != LuaToken::End)
+                        method |= is(j++, ":");
+                }
+                scopes.push_back({ Block::Function, {}, false, brackets.size() });
+                if (method)
+                    scopes.back().locals.push_back("self");
+                i = declare_params(j);
+                continue;
+            } else if (t.text == "for") {
+                scopes.push_back({ Block::For, {}, true, 0 });
+                for (++i; tokens[i].type == LuaToken::Name || is(i, ","); ++i)
+                    if (tokens[i].type == LuaToken::Name)
+                        scopes.back().locals.push_back(tokens[i].text);
+                continue;
+            } else if (t.text == "do") {
+                if (scopes.back().waiting_do)
+                    scopes.back().waiting_do = false;
+                else
+                    scopes.push_back({ Block::Other, {}, false, 0 });
+            } else if (t.text == "if" || t.text == "repeat") {
+                scopes.push_back({ Block::Other, {}, false, 0 });
+            } else if (t.text == "else" || t.text == "elseif") {
+                scopes.back().locals.clear();
+            } else if (t.text == "end" || t.text == "until") {
+                pop_scope();
+            } else if (t.text == "goto") {
+                i += 2;
+                continue;
+            }
+            ++i;
+            continue;
+        }
+
+        if (t.type == LuaToken::Symbol) {
+            if (t.text == "(" || t.text == "[" || t.text == "{")
+                brackets.push_back(t.text[0]);
+            else if ((t.text == ")" || t.text == "]" || t.text == "}") && !brackets.empty())
+                brackets.pop_back();
+            else if (t.text == "::")   // label
+                i += 2;
+            ++i;
+            continue;
+        }
+
+        if (t.type == LuaToken::Name) {
+            bool field = i > 0 && (is(i - 1, ".") || is(i - 1, ":"));
+            bool in_table = !brackets.empty() && brackets.back() == '{';
+            bool key = in_table && is(i + 1, "=") && (is(i - 1, "{") || is(i - 1, ",") || is(i - 1, ";"));
+            if (!field && !key && !is_local(t.text)) {
+                // assignment target: `name =` or `name, name2 = ...` (outside of brackets)
+                bool assigned = false;
+                if (statement_level()) {
+                    size_t j = i + 1;
+                    while (is(j, ",") && tokens[j + 1].type == LuaToken::Name)
+                        j += 2;
+                    assigned = is(j, "=");
+                }
+                uses.push_back({ std::string(t.text), t.line, assigned, in_function() });
+            }
+        }
+        ++i;
+    }
+
+    return uses;
+}
+
+}
+
+// `declared_by_chunk` receives the globals assigned in the main chunk
+static bool check_globals(lua_State* L, std::string_view code, std::vector<std::string>* errors,
+                          std::set<std::string>& declared_by_chunk)
+{
+    std::vector<GlobalUse> uses = find_globals(code);
+
+    for (GlobalUse const& use : uses)
+        if (use.assigned && !use.in_function)
+            declared_by_chunk.insert(use.name);
+
+    luaw_push_globals(L);                                   // globals
+    bool strict = lua_getmetatable(L, -1);
+    if (strict)
+        lua_getfield(L, -1, "__declared");                  // globals, mt, declared
+    else
+        lua_pushnil(L);                                     // globals, nil
+    int declared = lua_gettop(L);
+    int globals = strict ? declared - 2 : declared - 1;
+
+    auto exists = [&](std::string const& name) {
+        lua_pushlstring(L, name.data(), name.size());
+        lua_rawget(L, globals);
+        bool found = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!found && lua_istable(L, declared)) {
+            lua_pushlstring(L, name.data(), name.size());
+            lua_rawget(L, declared);
+            found = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+        }
+        return found;
+    };
+
+    bool ok = true;
+    for (GlobalUse const& use : uses) {
+        if (declared_by_chunk.contains(use.name) || exists(use.name))
+            continue;
+        if (use.assigned && !use.in_function)
+            continue;
+        ok = false;
+        if (errors)
+            errors->push_back("line " + std::to_string(use.line) + ": "
+                + (use.assigned ? "assign to undeclared variable '" : "variable '") + use.name
+                + (use.assigned ? "'" : "' is not declared"));
+    }
+
+    lua_settop(L, globals - 1);
+    return ok;
+}
+
+bool luaw_check_globals(lua_State* L, std::string_view code, std::vector<std::string>* errors)
+{
+    std::set<std::string> declared_by_chunk;
+    return check_globals(L, code, errors, declared_by_chunk);
+}
+
+//
+// ALLOCATOR
+//
+
+namespace {
+
+// Accounting allocator, optionally enforcing a memory limit: when an allocation would go over the limit it
+// fails, and Lua raises a memory error (LUA_ERRMEM) after trying an emergency collection.
+//
+// When `pooled`, it's also a size-class pool allocator. Blocks up to `max_small` bytes are carved from large
+// chunks and recycled through one free list per size class; Lua always gives the size of the block being freed,
+// so blocks need no header. A state is only used by one thread at a time, so the free lists need no locking.
+// All chunks are released at once when the state is closed.
+class LuaAllocator {
+public:
+    LuaAllocator(bool pooled, size_t limit) : limit(limit), pooled_(pooled) {}
+    LuaAllocator(LuaAllocator const&) = delete;
+    LuaAllocator& operator=(LuaAllocator const&) = delete;
+    ~LuaAllocator() { for (void* chunk : chunks_) free(chunk); }
+
+    static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    LuaAllocStats stats;
+    size_t        limit;    // 0 = unlimited
+
+private:
+    static constexpr size_t class_sizes[] = { 16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512 };
+    static constexpr size_t n_classes = std::size(class_sizes);
+    static constexpr size_t max_small = 512;
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    static constexpr auto class_index = [] {   // size class for each multiple of 16
+        std::array<uint8_t, max_small / 16 + 1> idx {};
+        size_t c = 0;
+        for (size_t i = 0; i < idx.size(); ++i) {
+            while (class_sizes[c] < i * 16)
+                ++c;
+            idx[i] = (uint8_t) c;
+        }
+        return idx;
+    }();
+
+    static size_t size_class(size_t sz) { return class_index[(sz + 15) / 16]; }
+
+    [[nodiscard]] bool from_pool(size_t sz) const { return pooled_ && sz <= max_small; }
+
+    bool over_limit(size_t grow) {
+        if (limit == 0 || stats.bytes_in_use + grow <= limit)
+            return false;
+        ++stats.limit_failures;
+        return true;
+    }
+
+    void* allocate(size_t sz);
+    void  deallocate(void* ptr, size_t sz);
+
+    struct FreeBlock { FreeBlock* next; };
+
+    bool               pooled_;
+    FreeBlock*         free_[n_classes] {};
+    char*              bump_ = nullptr;
+    char*              bump_end_ = nullptr;
+    std::vector<void*> chunks_;
+};
+
+void* LuaAllocator::allocate(size_t sz)
+{
+    if (over_limit(sz))
+        return nullptr;
+
+    void* ptr;
+    if (!from_pool(sz)) {
+        ptr = malloc(sz);
+        if (!ptr)
+            return nullptr;
+        ++stats.large_allocations;
+    } else {
+        size_t c = size_class(sz);
+        if (free_[c]) {
+            ptr = free_[c];
+            free_[c] = free_[c]->next;
+        } else {
+            if (bump_ + class_sizes[c] > bump_end_) {
+                void* chunk = malloc(chunk_size);
+                if (!chunk)
+                    return nullptr;
+                chunks_.push_back(chunk);
+                bump_ = (char *) chunk;
+                bump_end_ = bump_ + chunk_size;
+                ++stats.chunks;
+                stats.chunk_bytes += chunk_size;
+            }
+            ptr = bump_;
+            bump_ += class_sizes[c];
+        }
+    }
+
+    ++stats.allocations;
+    stats.bytes_in_use += sz;
+    stats.peak_bytes = std::max(stats.peak_bytes, stats.bytes_in_use);
+    return ptr;
+}
+
+void LuaAllocator::deallocate(void* ptr, size_t sz)
+{
+    if (!from_pool(sz)) {
+        free(ptr);
+    } else {
+        size_t c = size_class(sz);
+        auto block = (FreeBlock *) ptr;
+        block->next = free_[c];
+        free_[c] = block;
+    }
+
+    ++stats.frees;
+    stats.bytes_in_use -= sz;
+}
+
+void* LuaAllocator::alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    auto a = (LuaAllocator *) ud;
+
+    if (ptr == nullptr)
+        osize = 0;   // when allocating, Lua uses `osize` to tell the type of the object
+
+    if (nsize == 0) {
+        if (ptr)
+            a->deallocate(ptr, osize);
+        return nullptr;
+    }
+
+    if (ptr == nullptr)
+        return a->allocate(nsize);
+
+    if (nsize > osize && a->over_limit(nsize - osize))
+        return nullptr;
+
+    ++a->stats.reallocations;
+
+    if (!a->from_pool(osize) && !a->from_pool(nsize)) {
+        void* nptr = realloc(ptr, nsize);
+        if (nptr) {
+            a->stats.bytes_in_use += nsize - osize;
+            a->stats.peak_bytes = std::max(a->stats.peak_bytes, a->stats.bytes_in_use);
+        }
+        return nptr;
+    }
+
+    if (a->from_pool(osize) && a->from_pool(nsize) && size_class(osize) == size_class(nsize)) {
+        a->stats.bytes_in_use += nsize - osize;
+        a->stats.peak_bytes = std::max(a->stats.peak_bytes, a->stats.bytes_in_use);
+        return ptr;
+    }
+
+    size_t limit = std::exchange(a->limit, 0);   // already checked
+    void* nptr = a->allocate(nsize);
+    a->limit = limit;
+    if (!nptr)
+        return nullptr;
+    memcpy(nptr, ptr, std::min(osize, nsize));
+    --a->stats.allocations;
+    --a->stats.frees;
+    a->deallocate(ptr, osize);
+    return nptr;
+}
+
+int luaw_panic(lua_State* L)
+{
+    const char* msg = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
+    return 0;
+}
+
+//
+// STATE DATA
+//
+
+// Per-state data used by luaw, kept in a userdata in the registry.
+
+struct LuaStateData {
+    // GC accounting
+    size_t     gc_cycles = 0;
+    size_t     live_after_cycle = 0;
+    size_t     live_sampled_cycle = 0;   // cycle when `live_after_cycle` was sampled
+    LuaGcStats gc_stats;
+
+    // execution budget (see `LuaBudgetGuard`)
+    bool                                  budget_active = false;
+    bool                                  budget_exceeded = false;
+    size_t                                budget_instructions = 0;   // remaining, 0 = unlimited
+    std::chrono::steady_clock::time_point budget_deadline {};        // epoch = no deadline
+
+    // profiler (see `LuaProfiler`)
+    LuaProfiler*                          profiler = nullptr;
+    int                                   profiler_countdown = 0;    // instructions until the profiler is called
+
+    int                                   hook_count = 0;            // instructions between two calls to the hook
+
+    // compiled chunks, most recently used first (see `LuaStateOptions::chunk_cache`)
+    struct CachedChunk {
+        std::string name;
+        std::string source;   // compared in full, so hash collisions can't return a wrong chunk
+        int         ref;
+    };
+    using ChunkKey = std::pair<std::string_view, std::string_view>;   // name, source (views of the cached chunk)
+    struct ChunkKeyHash {
+        size_t operator()(ChunkKey const& k) const {
+            std::hash<std::string_view> h;
+            return h(k.first) * 31 + h(k.second);
+        }
+    };
+    size_t                                                                        chunk_cache_capacity = 0;
+    std::list<CachedChunk>                                                        chunk_cache;
+    std::unordered_map<ChunkKey, std::list<CachedChunk>::iterator, ChunkKeyHash>  chunk_cache_index;
+    LuaChunkCacheStats                                                            chunk_cache_stats;
+
+    std::string                                                                   bytecode_cache_dir;   // see `luaw_dofile`
+};
+
+size_t live_bytes(lua_State* L)
+{
+    void* ud;
+    if (lua_getallocf(L, &ud) == LuaAllocator::alloc)
+        return ((LuaAllocator *) ud)->stats.bytes_in_use;
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    int b = lua_gc(L, LUA_GCCOUNTB, 0);
+    if (kb < 0 || b < 0)   // not available (e.g. in a finalizer, in Lua 5.4.4+)
+        return 0;
+    return (size_t) kb * 1024 + (size_t) b;
+}
+
+LuaStateData* state_data(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "luaw_state");
+    auto sd = (LuaStateData *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return sd;
+}
+
+// GC accounting: a finalizable userdata that isn't referenced anywhere is collected in the next GC cycle; its
+// finalizer records the end of the cycle and creates the next sentinel. `lua_gc` can't be called from a
+// finalizer, so unless the allocator counts the live bytes, they are sampled by the next `luaw_memory`.
+
+void push_gc_sentinel(lua_State* L);
+
+int gc_sentinel_finalizer(lua_State* L)
+{
+    if (LuaStateData* sd = state_data(L)) {
+        ++sd->gc_cycles;
+        void* ud;
+        if (lua_getallocf(L, &ud) == LuaAllocator::alloc) {
+            sd->live_after_cycle = ((LuaAllocator *) ud)->stats.bytes_in_use;
+            sd->live_sampled_cycle = sd->gc_cycles;
+        }
+    }
+    push_gc_sentinel(L);
+    lua_pop(L, 1);
+    return 0;
+}
+
+void push_gc_sentinel(lua_State* L)
+{
+    lua_newuserdata(L, 1);
+    if (luaL_newmetatable(L, "luaw_gc_sentinel")) {
+        lua_pushcfunction(L, gc_sentinel_finalizer);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+}
+
+int state_data_finalizer(lua_State* L)   // called by lua_close
+{
+    ((LuaStateData *) lua_touserdata(L, 1))->~LuaStateData();
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luaw_state");
+    return 0;
+}
+
+void setup_state_data(lua_State* L)
+{
+    auto sd = new (lua_newuserdata(L, sizeof(LuaStateData))) LuaStateData();
+    sd->live_after_cycle = live_bytes(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, state_data_finalizer);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luaw_state");
+
+    push_gc_sentinel(L);
+    lua_pop(L, 1);
+}
+
+}
+
+lua_State* luaw_newstate()
+{
+    return luaw_newstate(LuaStateOptions {});
+}
+
+lua_State* luaw_newstate(LuaStateOptions const& options)
+{
+    lua_State* L = nullptr;
+
+    if (options.pool_allocator || options.memory_limit != 0) {
+        auto allocator = new LuaAllocator(options.pool_allocator, options.memory_limit);
+        L = lua_newstate(LuaAllocator::alloc, allocator);
+        if (L) {
+            lua_atpanic(L, luaw_panic);
+        } else {
+            delete allocator;
+#if LUAW == JIT
+            if (options.memory_limit == 0)
+                L = luaL_newstate();   // LuaJIT doesn't support custom allocators on some platforms
+            else
+                return nullptr;        // memory limit too low, or unsupported
+#else
+            return nullptr;            // memory limit too low
+#endif
+        }
+    } else {
+        L = luaL_newstate();
+    }
+
+    luaL_openlibs(L);
+    setup_state_data(L);
+
+    if (options.strict)
+        setup_strict(L);
+    if (options.chunk_cache)
+        luaw_set_chunk_cache(L, options.chunk_cache);
+    if (!options.bytecode_cache_dir.empty())
+        luaw_set_bytecode_cache(L, std::string(options.bytecode_cache_dir));
+
+    return L;
+}
+
+void luaw_close(lua_State* L)
+{
+    void* ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    lua_close(L);
+    if (f == LuaAllocator::alloc)
+        delete (LuaAllocator *) ud;
+}
+
+std::optional<LuaAllocStats> luaw_alloc_stats(lua_State* L)
+{
+    void* ud;
+    if (lua_getallocf(L, &ud) != LuaAllocator::alloc)
+        return {};
+    return ((LuaAllocator *) ud)->stats;
+}
+
+LuaMemoryStats luaw_memory(lua_State* L)
+{
+    LuaMemoryStats m;
+    m.live = live_bytes(L);
+
+    void* ud;
+    if (lua_getallocf(L, &ud) == LuaAllocator::alloc) {
+        auto a = (LuaAllocator *) ud;
+        m.peak = a->stats.peak_bytes;
+        m.limit = a->limit;
+    }
+
+    if (LuaStateData* sd = state_data(L)) {
+        if (sd->live_sampled_cycle != sd->gc_cycles) {
+            sd->live_after_cycle = m.live;
+            sd->live_sampled_cycle = sd->gc_cycles;
+        }
+        m.gc_cycles = sd->gc_cycles;
+        m.gc_debt = m.live > sd->live_after_cycle ? m.live - sd->live_after_cycle : 0;
+    }
+
+    return m;
+}
+
+bool luaw_set_memory_limit(lua_State* L, size_t limit)
+{
+    void* ud;
+    if (lua_getallocf(L, &ud) != LuaAllocator::alloc)
+        return false;
+    ((LuaAllocator *) ud)->limit = limit;
+    return true;
+}
+
+//
+// GARBAGE COLLECTION
+//
+
+static void record_gc_pause(lua_State* L, std::chrono::steady_clock::time_point start, bool completed)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    if (LuaStateData* sd = state_data(L)) {
+        LuaGcStats& st = sd->gc_stats;
+        ++st.pauses;
+        st.cycles_completed += completed;
+        st.last_pause = elapsed;
+        st.max_pause = std::max(st.max_pause, elapsed);
+        st.total_pause += elapsed;
+    }
+}
+
+bool luaw_gc_mode(lua_State* L, LuaGcMode mode)
+{
+#if LUAW == JIT
+    (void) L;
+    return mode == LuaGcMode::Incremental;
+#else
+    lua_gc(L, mode == LuaGcMode::Generational ? LUA_GCGEN : LUA_GCINC, 0, 0);
+    if (LuaStateData* sd = state_data(L))
+        sd->gc_stats.mode = mode;
+    return true;
+#endif
+}
+
+bool luaw_gc_step(lua_State* L, std::chrono::microseconds budget)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + budget;
+    bool completed = false;
+
+    // in generational mode a step is a whole (minor or major) collection, so it can't be split
+    LuaStateData* sd = state_data(L);
+    bool generational = sd && sd->gc_stats.mode == LuaGcMode::Generational;
+
+    do {
+        completed = lua_gc(L, LUA_GCSTEP, 0) != 0;   // one basic step
+    } while (!completed && !generational && std::chrono::steady_clock::now() < deadline);
+
+    record_gc_pause(L, start, completed);
+    return completed;
+}
+
+void luaw_gc_collect(lua_State* L)
+{
+    auto start = std::chrono::steady_clock::now();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    record_gc_pause(L, start, true);
+}
+
+LuaGcStats luaw_gc_stats(lua_State* L)
+{
+    LuaStateData* sd = state_data(L);
+    return sd ? sd->gc_stats : LuaGcStats {};
+}
+
+//
+// COUNT HOOK
+//
+
+// A single count hook is shared by the execution budget and the profiler: it's called every `hook_count`
+// instructions, the smallest interval needed by any of them.
+
+static constexpr int hook_interval = 1000;   // instructions between two clock checks
+
+void luaw_hook(lua_State* L, lua_Debug* ar);
+
+static void update_hook(lua_State* L, LuaStateData* sd)
+{
+    int count = 0;
+    auto need = [&count](int n) { count = (count == 0) ? n : std::min(count, n); };
+
+    if (sd->budget_active) {
+        if (sd->budget_exceeded)
+            need(1);                                                  // keep failing if the error is caught
+        else if (sd->budget_instructions != 0 && sd->budget_instructions < (size_t) hook_interval)
+            need((int) sd->budget_instructions);
+        else
+            need(hook_interval);
+    }
+    if (sd->profiler)
+        need(std::max(sd->profiler_countdown, 1));
+
+    sd->hook_count = count;
+    if (count == 0)
+        lua_sethook(L, nullptr, 0, 0);
+    else
+        lua_sethook(L, luaw_hook, LUA_MASKCOUNT, count);
+}
+
+void luaw_hook(lua_State* L, lua_Debug* ar)
+{
+    if (ar->event != LUA_HOOKCOUNT)
+        return;
+    LuaStateData* sd = state_data(L);
+    if (!sd)
+        return;
+
+    if (sd->budget_active && !sd->budget_exceeded) {
+        if (sd->budget_instructions != 0) {
+            if (sd->budget_instructions <= (size_t) sd->hook_count)
+                sd->budget_exceeded = true;
+            else
+                sd->budget_instructions -= (size_t) sd->hook_count;
+        }
+        if (sd->budget_deadline != std::chrono::steady_clock::time_point {} && std::chrono::steady_clock::now() >= sd->budget_deadline)
+            sd->budget_exceeded = true;
+    }
+
+    if (sd->profiler) {
+        sd->profiler_countdown -= sd->hook_count;
+        if (sd->profiler_countdown <= 0)
+            sd->profiler_countdown = sd->profiler->on_hook(L);
+    }
+
+    update_hook(L, sd);
+    if (sd->budget_active && sd->budget_exceeded)
+        luaL_error(L, "execution budget exceeded");
+}
+
+//
+// EXECUTION BUDGET
+//
+
+LuaBudgetGuard::LuaBudgetGuard(lua_State* L, LuaBudget const& budget)
+    : L_(L), previous_hook_(lua_gethook(L)), previous_mask_(lua_gethookmask(L)), previous_count_(lua_gethookcount(L))
+{
+    LuaStateData* sd = state_data(L);
+    if (!sd)
+        return;
+
+    previous_ = { sd->budget_active, sd->budget_exceeded, sd->budget_instructions, sd->budget_deadline };
+
+    sd->budget_active = budget.instructions != 0 || budget.time.count() != 0;
+    sd->budget_exceeded = false;
+    sd->budget_instructions = budget.instructions;
+    sd->budget_deadline = budget.time.count() != 0 ? std::chrono::steady_clock::now() + budget.time : std::chrono::steady_clock::time_point {};
+    update_hook(L, sd);
+}
+
+LuaBudgetGuard::~LuaBudgetGuard()
+{
+    LuaStateData* sd = state_data(L_);
+    if (!sd)
+        return;
+
+    sd->budget_active = previous_.active;
+    sd->budget_exceeded = previous_.exceeded;
+    sd->budget_instructions = previous_.instructions;
+    sd->budget_deadline = previous_.deadline;
+
+    if (sd->budget_active || sd->profiler)
+        update_hook(L_, sd);
+    else
+        lua_sethook(L_, previous_hook_, previous_mask_, previous_count_);
+}
+
+bool LuaBudgetGuard::exceeded() const
+{
+    LuaStateData* sd = state_data(L_);
+    return sd && sd->budget_exceeded;
+}
+
+bool luaw_budget_exceeded(lua_State* L)
+{
+    LuaStateData* sd = state_data(L);
+    return sd && sd->budget_active && sd->budget_exceeded;
+}
+
+//
+// PROFILER
+//
+
+LuaProfiler::LuaProfiler(lua_State* L, LuaProfilerConfig const& config)
+    : L_(L), config_(config)
+{
+    if (config_.instructions == 0 && config_.interval.count() == 0)
+        config_.interval = std::chrono::milliseconds(10);
+    next_sample_ = std::chrono::steady_clock::now() + config_.interval;
+
+    LuaStateData* sd = state_data(L);
+    if (!sd)
+        throw std::runtime_error("State was not created with luaw_newstate");
+    if (sd->profiler)
+        throw std::runtime_error("A profiler is already attached to this state");
+
+    sd->profiler = this;
+    sd->profiler_countdown = config_.instructions ? config_.instructions : hook_interval;
+    update_hook(L, sd);
+}
+
+LuaProfiler::~LuaProfiler()
+{
+    stop();
+}
+
+void LuaProfiler::stop()
+{
+    LuaStateData* sd = state_data(L_);
+    if (sd && sd->profiler == this) {
+        sd->profiler = nullptr;
+        update_hook(L_, sd);
+    }
+}
+
+int LuaProfiler::on_hook(lua_State* L)
+{
+    if (config_.instructions != 0) {
+        sample(L);
+        return config_.instructions;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_sample_) {
+        sample(L);
+        next_sample_ = now + config_.interval;
+    }
+    return hook_interval;
+}
+
+static std::string frame_name(lua_Debug const& ar)
+{
+    if (*ar.what == 'C')
+        return (ar.name ? ar.name : "?") + "@[C]"s;
+
+    // chunk name, as given to `luaw_do` (the source itself is used as name by `luaL_loadstring`)
+    std::string chunk;
+    if (ar.source[0] == '@' || ar.source[0] == '=')
+        chunk = ar.source + 1;
+    else if (strlen(ar.source) <= 60 && !strchr(ar.source, '\n'))
+        chunk = ar.source;
+    else
+        chunk = ar.short_src;
+
+    if (*ar.what == 'm')
+        return "main@" + chunk;
+    return (ar.name ? ar.name : "?") + "@"s + chunk + ":" + std::to_string(ar.linedefined);
+}
+
+void LuaProfiler::sample(lua_State* L)
+{
+    std::vector<std::string> frames;
+    lua_Debug ar;
+    for (int level = 0; (size_t) level < config_.max_depth && lua_getstack(L, level, &ar); ++level) {
+        lua_getinfo(L, "Sn", &ar);
+        frames.push_back(frame_name(ar));
+    }
+    if (frames.empty())
+        return;
+
+    std::string stack;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {   // folded stacks start at the root
+        if (!stack.empty())
+            stack += ';';
+        for (char c : *it)
+            stack += (c == ';' || c == ' ') ? '_' : c;
+    }
+
+    std::lock_guard lock(mutex_);
+    ++stacks_[stack];
+    ++samples_;
+}
+
+std::string LuaProfiler::folded() const
+{
+    std::lock_guard lock(mutex_);
+    std::string out;
+    for (auto const& [stack, count] : stacks_)
+        out += stack + " " + std::to_string(count) + "\n";
+    return out;
+}
+
+size_t LuaProfiler::samples() const
+{
+    std::lock_guard lock(mutex_);
+    return samples_;
+}
+
+void LuaProfiler::clear()
+{
+    std::lock_guard lock(mutex_);
+    stacks_.clear();
+    samples_ = 0;
+}
+
+//
+// CODE EXECUTION
+//
+
+// raises the error left by a failed load
+static void check_load(lua_State* L, int r)
+{
+    if (r == LUA_ERRSYNTAX) {
+        std::string msg = "Syntax error: "s + lua_tostring(L, -1);
+        lua_pop(L, 1);
+        luaL_error(L, msg.c_str());
+    } else if (r == LUA_ERRMEM) {
+        luaL_error(L, "Memory error");
+    }
+}
+
+// pushes the compiled chunk
+static void load_chunk(lua_State* L, const char* data, size_t sz, std::string const& name)
+{
+    check_load(L, luaL_loadbuffer(L, data, sz, name.c_str()));
+}
+
+// raises the error left by a failed call
+static void check_run(lua_State* L, int r)
+{
+    if (r == LUA_ERRRUN) {
+        std::string msg = (luaw_budget_exceeded(L) ? "Budget exceeded: "s : "Runtime error: "s) + lua_tostring(L, -1);
+        lua_pop(L, 1);
+        luaL_error(L, msg.c_str());
+    } else if (r == LUA_ERRMEM) {
+        luaL_error(L, "Runtime memory error");
+    } else if (r == LUA_ERRERR){
+        luaL_error(L, "Error running the error message handler");
+    }
+}
+
+// calls the function below its `nargs` arguments
+static void run_chunk(lua_State* L, int nargs, int nresults)
+{
+    check_run(L, lua_pcall(L, nargs, nresults, 0));
+}
+
+static void evict_chunks(lua_State* L, LuaStateData* sd, size_t keep)
+{
+    while (sd->chunk_cache.size() > keep) {
+        auto& last = sd->chunk_cache.back();
+        luaL_unref(L, LUA_REGISTRYINDEX, last.ref);
+        sd->chunk_cache_index.erase(LuaStateData::ChunkKey { last.name, last.source });
+        sd->chunk_cache.pop_back();
+    }
+    sd->chunk_cache_stats.entries = sd->chunk_cache.size();
+}
+
+// pushes the compiled chunk, from the cache if possible (only source code is cached, not bytecode); returns
+// the status of `luaL_loadbuffer` instead of raising errors
+static int load_chunk_cached(lua_State* L, const char* data, size_t sz, std::string const& name)
+{
+    LuaStateData* sd = state_data(L);
+    if (!sd || sd->chunk_cache_capacity == 0 || (sz > 0 && data[0] == LUA_SIGNATURE[0]))
+        return luaL_loadbuffer(L, data, sz, name.c_str());
+
+    auto it = sd->chunk_cache_index.find(LuaStateData::ChunkKey { name, std::string_view(data, sz) });   // no copy on a hit
+    if (it != sd->chunk_cache_index.end()) {
+        ++sd->chunk_cache_stats.hits;
+        sd->chunk_cache.splice(sd->chunk_cache.begin(), sd->chunk_cache, it->second);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, it->second->ref);
+        return LUA_OK;
+    }
+
+    ++sd->chunk_cache_stats.misses;
+    int r = luaL_loadbuffer(L, data, sz, name.c_str());
+    if (r != LUA_OK)
+        return r;
+    lua_pushvalue(L, -1);
+    sd->chunk_cache.push_front({ name, std::string(data, sz), luaL_ref(L, LUA_REGISTRYINDEX) });
+    auto const& chunk = sd->chunk_cache.front();
+    sd->chunk_cache_index.emplace(LuaStateData::ChunkKey { chunk.name, chunk.source }, sd->chunk_cache.begin());
+    evict_chunks(L, sd, sd->chunk_cache_capacity);
+    return LUA_OK;
 }
 
-static const char* strict_lua = R"(
-local getinfo, error, rawset, rawget = debug.getinfo, error, rawset, rawget
-
-local mt = getmetatable(_G)
-if mt == nil then
-    mt = {}
-    setmetatable(_G, mt)
-end
-
-mt.__declared = {}
-
-local function what ()
-    local d = getinfo(3, "S")
-    return d and d.what or "C"
-end
-
-mt.__newindex = function (t, n, v)
-    if not mt.__declared[n] then
-        local w = what()
-        if w ~= "main" and w ~= "C" then
-            error("assign to undeclared variable '"..n.."'", 2)
-        end
-        mt.__declared[n] = true
-    end
-    rawset(t, n, v)
-end
-
-mt.__index = function (t, n)
-    if not mt.__declared[n] and what() ~= "C" then
-        error("variable '"..n.."' is not declared", 2)
-    end
-    return rawget(t, n)
-end
-)";
+void luaw_set_chunk_cache(lua_State* L, size_t entries)
+{
+    if (LuaStateData* sd = state_data(L)) {
+        sd->chunk_cache_capacity = entries;
+        evict_chunks(L, sd, entries);
+    }
+}
 
-lua_State* luaw_newstate()
+LuaChunkCacheStats luaw_chunk_cache_stats(lua_State* L)
 {
-    lua_State* L = luaL_newstate();
-    luaL_openlibs(L);
+    LuaStateData* sd = state_data(L);
+    return sd ? sd->chunk_cache_stats : LuaChunkCacheStats {};
+}
 
-    luaw_do(L, strict_lua, 0, "strict.lua");
+void luaw_do(lua_State* L, uint8_t* data, size_t sz, int nresults, std::string const& name)
+{
+    check_load(L, load_chunk_cached(L, (const char *) data, sz, name));
+    run_chunk(L, 0, nresults);
+}
 
-    return L;
+LuaChunk::LuaChunk(lua_State* L, std::string_view code, std::string const& name)
+    : L_(L)
+{
+    load_chunk(L, code.data(), code.size(), name);
+    ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
-void luaw_do(lua_State* L, uint8_t* data, size_t sz, int nresults, std::string const& name)
+LuaChunk::LuaChunk(LuaChunk&& other) noexcept
+    : L_(other.L_), ref_(std::exchange(other.ref_, LUA_NOREF))
 {
-    int r = luaL_loadbuffer(L, (char const *) data, sz, name.c_str());
-    if (r == LUA_ERRSYNTAX) {
-        std::string msg = "Syntax error: "s + lua_tostring(L, -1);
-        lua_pop(L, 1);
-        luaL_error(L, msg.c_str());
-    } else if (r == LUA_ERRMEM) {
-        luaL_error(L, "Memory error");
+}
+
+LuaChunk& LuaChunk::operator=(LuaChunk&& other) noexcept
+{
+    if (this != &other) {
+        if (ref_ != LUA_NOREF)
+            luaL_unref(L_, LUA_REGISTRYINDEX, ref_);
+        L_ = other.L_;
+        ref_ = std::exchange(other.ref_, LUA_NOREF);
     }
+    return *this;
+}
 
-    r = lua_pcall(L, 0, nresults, 0);
-    if (r == LUA_ERRRUN) {
-        std::string msg = "Runtime error: "s + lua_tostring(L, -1);
+LuaChunk::~LuaChunk()
+{
+    if (ref_ != LUA_NOREF)
+        luaL_unref(L_, LUA_REGISTRYINDEX, ref_);
+}
+
+void LuaChunk::push() const
+{
+    lua_rawgeti(L_, LUA_REGISTRYINDEX, ref_);
+}
+
+void LuaChunk::run(int nresults) const
+{
+    push();
+    run_chunk(L_, 0, nresults);
+}
+
+struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; };
+// Feeds `lua_load` while inflating the compressed data, through a fixed buffer: memory use doesn't depend on
+// the size of the chunk, and decompression is interleaved with loading.
+struct InflateReader {
+    z_stream      zs {};
+    bool          done = false;
+    bool          error = false;
+    unsigned char buffer[16 * 1024];
+
+    static const char* read(lua_State*, void* ud, size_t* size) {
+        auto r = (InflateReader *) ud;
+        *size = 0;
+        while (*size == 0 && !r->done) {
+            r->zs.next_out = r->buffer;
+            r->zs.avail_out = sizeof r->buffer;
+            int ret = inflate(&r->zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+                r->done = true;
+            else if (ret != Z_OK)
+                r->done = r->error = true;
+            *size = sizeof r->buffer - r->zs.avail_out;
+        }
+        return *size ? (const char *) r->buffer : nullptr;
+    }
+};
+
+// pushes the chunk, returns the status of `lua_load`
+static int load_compressed(lua_State* L, LuaCompressedBytecode const& lcb)
+{
+    InflateReader reader;
+    reader.zs.next_in = lcb.data;
+    reader.zs.avail_in = (uInt) lcb.c;
+    if (inflateInit(&reader.zs) != Z_OK)
+        return LUA_ERRMEM;
+
+#if LUAW == JIT
+    int r = lua_load(L, InflateReader::read, &reader, lcb.f);
+#else
+    int r = lua_load(L, InflateReader::read, &reader, lcb.f, nullptr);
+#endif
+    inflateEnd(&reader.zs);
+
+    if (reader.error) {
         lua_pop(L, 1);
-        luaL_error(L, msg.c_str());
-    } else if (r == LUA_ERRMEM) {
-        luaL_error(L, "Runtime memory error");
-    } else if (r == LUA_ERRERR){
-        luaL_error(L, "Error running the error message handler");
+        lua_pushfstring(L, "corrupted compressed chunk '%s'", lcb.f);
+        return LUA_ERRSYNTAX;
     }
+    return r;
 }
 
-struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; };
 void luaw_do_z(lua_State* L, LuaCompressedBytecode lcb[], bool keep_results)
 {
-    size_t i = 0;
+    for (size_t i = 0; lcb[i].c != 0; ++i) {
+        check_load(L, load_compressed(L, lcb[i]));
+        run_chunk(L, 0, keep_results ? LUA_MULTRET : 0);
+    }
+}
 
-    while (lcb[i].c != 0) {
-        uint8_t result[lcb[i].u];
-        uncompress(result, &lcb[i].u, lcb[i].data, lcb[i].c);
-        luaw_do(L, result, lcb[i].u, keep_results ? LUA_MULTRET : 0, lcb[i].f);
-        ++i;
+// Embedded modules loaded by `require`: a searcher looks up the module name in a sorted index of the chunks,
+// and only decompresses and loads the chunk found.
+
+namespace {
+
+struct EmbeddedModules {
+    LuaCompressedBytecode*                      lcb;
+    std::vector<std::pair<std::string, size_t>> index;   // module name -> chunk, sorted by name
+
+    static int finalizer(lua_State* L) {
+        ((EmbeddedModules *) lua_touserdata(L, 1))->~EmbeddedModules();
+        return 0;
+    }
+};
+
+std::string module_name(std::string_view filename)   // "./a/b.lua" -> "a.b"
+{
+    if (filename.starts_with("./"))
+        filename.remove_prefix(2);
+    if (filename.ends_with(".lua"))
+        filename.remove_suffix(4);
+    std::string name(filename);
+    std::replace(name.begin(), name.end(), '/', '.');
+    return name;
+}
+
+int embedded_searcher(lua_State* L)
+{
+    auto modules = (EmbeddedModules *) lua_touserdata(L, lua_upvalueindex(1));
+    std::string_view name = luaL_checkstring(L, 1);
+
+    auto it = std::lower_bound(modules->index.begin(), modules->index.end(), name,
+                               [](auto const& entry, std::string_view n) { return entry.first < n; });
+    if (it == modules->index.end() || it->first != name) {
+#if LUAW == JIT
+        lua_pushfstring(L, "\n\tno embedded module '%s'", name.data());
+#else
+        lua_pushfstring(L, "no embedded module '%s'", name.data());
+#endif
+        return 1;
+    }
+
+    LuaCompressedBytecode const& lcb = modules->lcb[it->second];
+    check_load(L, load_compressed(L, lcb));   // the chunk is the loader
+    lua_pushstring(L, lcb.f);
+    return 2;
+}
+
+}
+
+void luaw_register_z(lua_State* L, LuaCompressedBytecode lcb[])
+{
+    auto modules = new (lua_newuserdata(L, sizeof(EmbeddedModules))) EmbeddedModules { lcb, {} };
+    lua_newtable(L);
+    lua_pushcfunction(L, EmbeddedModules::finalizer);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    for (size_t i = 0; lcb[i].c != 0; ++i) {
+        std::string name = module_name(lcb[i].f);
+        if (name.ends_with(".init"))   // "a/init.lua" is also module "a"
+            modules->index.emplace_back(name.substr(0, name.size() - 5), i);
+        modules->index.emplace_back(std::move(name), i);
+    }
+    std::stable_sort(modules->index.begin(), modules->index.end(),
+                     [](auto const& a, auto const& b) { return a.first < b.first; });
+
+    lua_pushcclosure(L, embedded_searcher, 1);
+
+    // insert the searcher after the preload searcher, so embedded modules are found before files
+    lua_getglobal(L, "package");
+#if LUAW == JIT
+    lua_getfield(L, -1, "loaders");
+#else
+    lua_getfield(L, -1, "searchers");
+#endif
+    int n = luaw_len(L, -1);
+    for (int i = n; i >= 2; --i) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
     }
+    lua_pushvalue(L, -3);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 3);
 }
 
 void luaw_do(lua_State* L, std::string const& buffer, int nresults, std::string const& name)
@@ -103,14 +1392,450 @@ void luaw_do(lua_State* L, std::string const& buffer, int nresults, std::string
     luaw_do(L, (uint8_t *) buffer.data(), buffer.length(), nresults, name);
 }
 
+// The globals assigned by the chunk are declared first, and the metatable of `_G` is removed while it runs, so
+// its accesses to globals don't go through `strict_index`/`strict_newindex`.
+void luaw_do_checked(lua_State* L, std::string const& buffer, int nresults, std::string const& name)
+{
+    bool ok;
+    {
+        std::vector<std::string> errors;
+        std::set<std::string> declared_by_chunk;
+        ok = check_globals(L, buffer, &errors, declared_by_chunk);
+        if (!ok) {
+            lua_pushstring(L, ("Undeclared globals: " + errors[0]).c_str());
+        } else {
+            luaw_push_globals(L);
+            if (lua_getmetatable(L, -1)) {
+                lua_getfield(L, -1, "__declared");
+                if (lua_istable(L, -1)) {
+                    for (std::string const& global : declared_by_chunk) {
+                        lua_pushlstring(L, global.data(), global.size());
+                        lua_pushboolean(L, 1);
+                        lua_rawset(L, -3);
+                    }
+                }
+                lua_pop(L, 2);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    if (!ok)
+        lua_error(L);   // raised once the C++ objects are destroyed
+
+    check_load(L, load_chunk_cached(L, buffer.data(), buffer.size(), name));
+    int base = lua_gettop(L) - 1;
+    luaw_push_globals(L);                                   // chunk, globals
+    if (!lua_getmetatable(L, -1))
+        lua_pushnil(L);                                     // chunk, globals, mt
+    lua_insert(L, base + 1);
+    lua_insert(L, base + 1);                                // globals, mt, chunk
+    lua_pushnil(L);
+    lua_setmetatable(L, base + 1);
+
+    int r = lua_pcall(L, 0, nresults, 0);
+    lua_pushvalue(L, base + 2);                             // restored even on errors
+    lua_setmetatable(L, base + 1);
+    lua_remove(L, base + 1);
+    lua_remove(L, base + 1);
+    check_run(L, r);
+}
+
+//
+// FILE LOADING
+//
+
+namespace {
+
+class MappedFile {
+public:
+    explicit MappedFile(std::string const& path) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ < 0 || fstat(fd_, &st_) != 0) {
+            close_();
+            return;
+        }
+        size_ = (size_t) st_.st_size;
+        if (size_ > 0) {
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (data_ == MAP_FAILED) {
+                data_ = nullptr;
+                close_();
+            }
+        }
+    }
+
+    ~MappedFile() { close_(); }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    [[nodiscard]] bool               ok() const { return fd_ >= 0; }
+    [[nodiscard]] const char*        data() const { return data_ ? (const char *) data_ : ""; }
+    [[nodiscard]] size_t             size() const { return size_; }
+    [[nodiscard]] struct stat const& stat() const { return st_; }
+
+private:
+    void close_() {
+        if (data_)
+            munmap(data_, size_);
+        if (fd_ >= 0)
+            close(fd_);
+        data_ = nullptr;
+        fd_ = -1;
+    }
+
+    int         fd_ = -1;
+    void*       data_ = nullptr;
+    size_t      size_ = 0;
+    struct stat st_ {};
+};
+
+#if LUAW == JIT
+const char* bytecode_version = LUAJIT_VERSION;
+#else
+const char* bytecode_version = LUA_RELEASE;
+#endif
+
+uint64_t fnv1a(std::string_view data, uint64_t h = 14695981039346656037ull)
+{
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+int dump_writer(lua_State*, const void* p, size_t sz, void* ud)
+{
+    ((std::string *) ud)->append((const char *) p, sz);
+    return 0;
+}
+
+// write the compiled chunk on the top of the stack, atomically (a reader sees the whole file, or no file)
+void write_bytecode(lua_State* L, std::string const& path)
+{
+    std::string bytecode;
+#if LUAW == JIT
+    lua_dump(L, dump_writer, &bytecode);
+#else
+    lua_dump(L, dump_writer, &bytecode, 0);
+#endif
+
+    std::string tmp = path + ".XXXXXX";   // unique, as other states (even in this process) may write the same entry
+    int fd = mkstemp(tmp.data());
+    if (fd < 0)
+        return;
+    fchmod(fd, 0644);                       // mkstemp creates the file readable only by the owner
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        unlink(tmp.c_str());
+        return;
+    }
+    bool ok = fwrite(bytecode.data(), 1, bytecode.size(), f) == bytecode.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        unlink(tmp.c_str());
+}
+
+// pushes the compiled file, from the bytecode cache if possible; returns the status of `luaL_loadbuffer`
+int load_file_cached(lua_State* L, MappedFile const& file, std::string const& filename, std::string const& name,
+                     std::string const& cache_dir)
+{
+    std::string_view source(file.data(), file.size());
+
+    std::string key = filename + '\0' + name + '\0' + std::to_string((long long) file.stat().st_mtime) + '\0'
+        + std::to_string(file.size()) + '\0' + std::to_string(fnv1a(source)) + '\0' + bytecode_version
+        + '\0' + std::to_string(sizeof(void*));
+    char hex[17];
+    snprintf(hex, sizeof hex, "%016llx", (unsigned long long) fnv1a(key));
+    std::string cache_path = cache_dir + "/" + hex + ".luac";
+
+    {
+        MappedFile cached(cache_path);
+        if (cached.ok() && cached.size() > 0) {
+            if (luaL_loadbuffer(L, cached.data(), cached.size(), name.c_str()) == LUA_OK)
+                return LUA_OK;
+            lua_pop(L, 1);   // invalid bytecode: compile from source
+        }
+    }
+
+    int r = luaL_loadbuffer(L, file.data(), file.size(), name.c_str());
+    if (r == LUA_OK && !(file.size() > 0 && source[0] == LUA_SIGNATURE[0]))
+        write_bytecode(L, cache_path);
+    return r;
+}
+
+}
+
+void luaw_set_bytecode_cache(lua_State* L, std::string const& dir)
+{
+    if (LuaStateData* sd = state_data(L))
+        sd->bytecode_cache_dir = dir;
+}
+
 void luaw_dofile(lua_State* L, std::string const& filename, int nresults, std::string const& name)
 {
-    std::ifstream f(filename);
-    if (!f.good())
-        luaL_error(L, "Could not open file '%s'", filename.c_str());
-    std::stringstream buffer;
-    buffer << f.rdbuf();
-    luaw_do(L, buffer.str(), nresults, name);
+    int r;
+    {
+        MappedFile file(filename);
+        if (!file.ok())
+            luaL_error(L, "Could not open file '%s'", filename.c_str());
+
+        LuaStateData* sd = state_data(L);
+        if (sd && !sd->bytecode_cache_dir.empty())
+            r = load_file_cached(L, file, filename, name, sd->bytecode_cache_dir);
+        else
+            r = load_chunk_cached(L, file.data(), file.size(), name);
+    }   // errors are raised after the file is unmapped
+
+    check_load(L, r);
+    run_chunk(L, 0, nresults);
+}
+
+//
+// PARALLEL LOADING
+//
+
+namespace {
+
+struct CompiledSource {
+    std::string bytecode {};
+    std::string error {};
+    int         status = LUA_OK;
+    bool        not_found = false;
+};
+
+std::string source_name(LuaSource const& source)
+{
+    if (!source.name.empty())
+        return source.name;
+    return source.filename.empty() ? "anonymous" : source.filename;
+}
+
+// Compiles the sources to bytecode on helper states, one per thread. Bytecode is not tied to the state that
+// compiled it, so it can be loaded in any state (of the same Lua build) without parsing again.
+std::vector<CompiledSource> compile_parallel(std::vector<LuaSource> const& sources, unsigned threads)
+{
+    std::vector<CompiledSource> compiled(sources.size());
+    std::atomic<size_t> next = 0;
+
+    auto worker = [&]() {
+        lua_State* H = luaL_newstate();
+        for (size_t i; (i = next++) < sources.size(); ) {
+            LuaSource const& source = sources[i];
+            CompiledSource& c = compiled[i];
+            if (!H) {
+                c.status = LUA_ERRMEM;
+                continue;
+            }
+
+            int r;
+            std::string name = source_name(source);
+            if (source.filename.empty() || !source.code.empty()) {
+                r = luaL_loadbuffer(H, source.code.data(), source.code.size(), name.c_str());
+            } else {
+                MappedFile file(source.filename);
+                if (!file.ok()) {
+                    c.not_found = true;
+                    continue;
+                }
+                r = luaL_loadbuffer(H, file.data(), file.size(), name.c_str());
+            }
+
+            if (r == LUA_OK) {
+#if LUAW == JIT
+                lua_dump(H, dump_writer, &c.bytecode);
+#else
+                lua_dump(H, dump_writer, &c.bytecode, 0);
+#endif
+            } else {
+                c.status = r;
+                if (const char* msg = lua_tostring(H, -1))
+                    c.error = msg;
+            }
+            lua_settop(H, 0);
+        }
+        if (H)
+            lua_close(H);
+    };
+
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min<size_t>(threads, sources.size()); ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+        t.join();
+
+    return compiled;
+}
+
+}
+
+void luaw_do_parallel(lua_State* L, std::vector<LuaSource> const& sources, unsigned threads)
+{
+    int load_status = LUA_OK, run_status = LUA_OK;
+    bool not_found = false;
+    {
+        std::vector<CompiledSource> compiled = compile_parallel(sources, threads);
+
+        for (size_t i = 0; i < compiled.size(); ++i) {
+            CompiledSource const& c = compiled[i];
+            if (c.not_found) {
+                lua_pushfstring(L, "Could not open file '%s'", sources[i].filename.c_str());
+                not_found = true;
+                break;
+            }
+            if (c.status != LUA_OK) {
+                lua_pushlstring(L, c.error.data(), c.error.size());
+                load_status = c.status;
+                break;
+            }
+            load_status = luaL_loadbuffer(L, c.bytecode.data(), c.bytecode.size(), source_name(sources[i]).c_str());
+            if (load_status != LUA_OK)
+                break;
+            run_status = lua_pcall(L, 0, 0, 0);
+            if (run_status != LUA_OK)
+                break;
+        }
+    }   // errors are raised after the bytecode is freed
+
+    if (not_found)
+        lua_error(L);
+    check_load(L, load_status);
+    check_run(L, run_status);
+}
+
+//
+// ARCHIVES
+//
+
+struct LuaArchive::Mapping {
+    std::shared_ptr<const void> file;      // keeps the file mapped
+    const char*                 data = nullptr;
+    LuaArchiveEntry const*      entries = nullptr;
+    uint32_t                    count = 0;
+
+    [[nodiscard]] std::string_view name(LuaArchiveEntry const& e) const { return { data + e.name_offset, e.name_len }; }
+
+    [[nodiscard]] LuaArchiveEntry const* find(std::string_view name_) const {
+        auto end = entries + count;
+        auto it = std::lower_bound(entries, end, name_, [this](auto const& e, std::string_view n) { return name(e) < n; });
+        return (it != end && name(*it) == name_) ? it : nullptr;
+    }
+};
+
+// maps the archive and validates its table of contents - the data is only checked when an entry is loaded, so
+// entries that are not used are never read from disk
+std::shared_ptr<const LuaArchive::Mapping> LuaArchive::map(std::string const& path)
+{
+    auto file = std::make_shared<const MappedFile>(path);
+    if (!file->ok())
+        throw std::runtime_error("Could not open archive '" + path + "'");
+
+    auto invalid = [&path]() { return std::runtime_error("Invalid archive '" + path + "'"); };
+
+    size_t size = file->size();
+    if (size < sizeof(LuaArchiveHeader))
+        throw invalid();
+    auto header = (LuaArchiveHeader const *) file->data();
+    if (memcmp(header->magic, luaw_archive_magic, sizeof luaw_archive_magic) != 0)
+        throw invalid();
+    if (header->count > (size - sizeof(LuaArchiveHeader)) / sizeof(LuaArchiveEntry))
+        throw invalid();
+
+    auto m = std::make_shared<Mapping>();
+    m->data = file->data();
+    m->entries = (LuaArchiveEntry const *) (m->data + sizeof(LuaArchiveHeader));
+    m->count = header->count;
+    m->file = std::move(file);
+
+    for (uint32_t i = 0; i < m->count; ++i) {
+        LuaArchiveEntry const& e = m->entries[i];
+        if (e.name_offset > size || e.name_len > size - e.name_offset || e.data_offset > size || e.size > size - e.data_offset)
+            throw invalid();
+        if (i > 0 && !(m->name(m->entries[i - 1]) < m->name(e)))
+            throw invalid();
+    }
+    return m;
+}
+
+LuaArchive::LuaArchive(std::string const& path)
+    : path_(path), mapping_(map(path))
+{
+}
+
+void LuaArchive::reload()
+{
+    reload(path());
+}
+
+void LuaArchive::reload(std::string const& path)
+{
+    auto m = map(path);   // throws before anything is changed
+    std::lock_guard lock(mutex_);
+    path_ = path;
+    mapping_ = std::move(m);
+}
+
+std::shared_ptr<const LuaArchive::Mapping> LuaArchive::mapping() const
+{
+    std::lock_guard lock(mutex_);
+    return mapping_;
+}
+
+void LuaArchive::load(lua_State* L, std::string const& name) const
+{
+    int r = LUA_OK;
+    bool found = false;
+    {
+        auto m = mapping();
+        if (LuaArchiveEntry const* e = m->find(name)) {
+            auto data = (unsigned char *) m->data + e->data_offset;
+            found = true;
+            if (crc32_z(0, data, (size_t) e->size) != e->crc32) {
+                lua_pushfstring(L, "corrupted archive entry '%s'", name.c_str());
+                r = LUA_ERRSYNTAX;
+            } else if (e->uncompressed == 0) {
+                r = luaL_loadbuffer(L, (const char *) data, e->size, name.c_str());   // straight from the mapping
+            } else {
+                r = load_compressed(L, { e->size, e->uncompressed, name.c_str(), data });
+            }
+        }
+    }   // errors are raised after the mapping is released
+
+    if (!found)
+        luaL_error(L, "Archive entry '%s' not found", name.c_str());
+    check_load(L, r);
+}
+
+void LuaArchive::run(lua_State* L, std::string const& name, int nresults) const
+{
+    load(L, name);
+    run_chunk(L, 0, nresults);
+}
+
+bool LuaArchive::contains(std::string const& name) const
+{
+    return mapping()->find(name) != nullptr;
+}
+
+std::vector<std::string> LuaArchive::names() const
+{
+    auto m = mapping();
+    std::vector<std::string> names;
+    names.reserve(m->count);
+    for (uint32_t i = 0; i < m->count; ++i)
+        names.emplace_back(m->name(m->entries[i]));
+    return names;
+}
+
+std::string LuaArchive::path() const
+{
+    std::lock_guard lock(mutex_);
+    return path_;
 }
 
 static std::string luaw_dump_table(lua_State* L, int index, bool pretty_print, size_t max_depth, size_t current_depth)
@@ -223,6 +1948,13 @@ int luaw_len(lua_State* L, int index)
 #endif
 }
 
+int luaw_absindex(lua_State* L, int index)
+{
+    if (index < 0 && index > LUA_REGISTRYINDEX)
+        return lua_gettop(L) + index + 1;
+    return index;
+}
+
 template<> int luaw_push<bool>(lua_State* L, bool const& t) { lua_pushboolean(L, t); return 1; }
 template<> bool luaw_is<bool>(lua_State* L, int index) { return lua_isboolean(L, index); }
 template<> bool luaw_to_(lua_State* L, int index) { return lua_toboolean(L, index); }
@@ -231,9 +1963,31 @@ template<nullptr_t> int luaw_push(lua_State* L, [[maybe_unused]] nullptr_t const
 template<> bool luaw_is<nullptr_t>(lua_State* L, int index) { return lua_isnil(L, index); }
 template<> nullptr_t luaw_to_([[maybe_unused]] lua_State* L, [[maybe_unused]] int index) { return nullptr; }
 
-template<> int luaw_push(lua_State* L, std::string const& t) { lua_pushstring(L, t.c_str()); return 1; }
+template<> int luaw_push(lua_State* L, std::string const& t) { lua_pushlstring(L, t.data(), t.size()); return 1; }
 template<> bool luaw_is<std::string>(lua_State* L, int index) { return lua_isstring(L, index); }
-template<> std::string luaw_to_<std::string>(lua_State* L, int index) { return lua_tostring(L, index); }
+template<> std::string luaw_to_<std::string>(lua_State* L, int index) {
+    size_t len;
+    const char* s = lua_tolstring(L, index, &len);
+    return { s, len };
+}
+
+// the views below point into the Lua string, so they are valid only while the value is on the stack
+
+template<> int luaw_push(lua_State* L, std::string_view const& t) { lua_pushlstring(L, t.data(), t.size()); return 1; }
+template<> bool luaw_is<std::string_view>(lua_State* L, int index) { return lua_isstring(L, index); }
+template<> std::string_view luaw_to_<std::string_view>(lua_State* L, int index) {
+    size_t len;
+    const char* s = lua_tolstring(L, index, &len);
+    return { s, len };
+}
+
+template<> int luaw_push(lua_State* L, std::span<const std::byte> const& t) { lua_pushlstring(L, (const char *) t.data(), t.size()); return 1; }
+template<> bool luaw_is<std::span<const std::byte>>(lua_State* L, int index) { return lua_type(L, index) == LUA_TSTRING; }
+template<> std::span<const std::byte> luaw_to_<std::span<const std::byte>>(lua_State* L, int index) {
+    size_t len;
+    const char* s = lua_tolstring(L, index, &len);
+    return { (const std::byte *) s, len };
+}
 
 template<> int luaw_push(lua_State* L, const char* t) { lua_pushstring(L, t); return 1; }
 template<> bool luaw_is<const char*>(lua_State* L, int index) { return lua_isstring(L, index); }
@@ -242,82 +1996,90 @@ template<> const char* luaw_to_<const char*>(lua_State* L, int index) { return l
 template<> int luaw_push(lua_State* L, lua_CFunction const& f) { lua_pushcfunction(L, f); return 1; }
 int luaw_push(lua_State* L, lua_CFunction f) { lua_pushcfunction(L, f); return 1; }
 
-void luaw_getfield(lua_State* L, int index, std::string const& field)
+// Walk a dotted path without building intermediate strings: each segment is pushed with its length
+// (Lua interns it), and the containing table is replaced by the segment value on each step.
+static bool luaw_walkfield(lua_State* L, std::string const& field, bool include_last)
 {
-    std::istringstream iss(field);
-    std::string property;
-
-    int top = lua_gettop(L);
-    int levels = 0;
+    std::string_view path = field;
 
-    lua_pushvalue(L, index);
+    for (;;) {
+        size_t dot = path.find('.');
+        bool last = (dot == std::string_view::npos);
+        if (last && !include_last)
+            return true;
 
-    while (std::getline(iss, property, '.')) {
-        lua_getfield(L, -1, property.c_str());
+        lua_pushlstring(L, path.data(), last ? path.size() : dot);
+        lua_gettable(L, -2);
         int type = lua_type(L, -1);
-        if (type == LUA_TNIL || (iss.peek() != EOF /* is not last */ && type != LUA_TTABLE)) {
-            lua_settop(L, top);
-            luaL_error(L, "Field '%s' not found.", field.c_str());
-        }
-        ++levels;
-    }
+        if (type == LUA_TNIL || (!last && include_last && type != LUA_TTABLE))
+            return false;
+        lua_replace(L, -2);
 
-    lua_insert(L, top + 1);
-    lua_pop(L, levels);
+        if (last)
+            return true;
+        path.remove_prefix(dot + 1);
+    }
 }
 
-bool luaw_hasfield(lua_State* L, int index, std::string const& field)
+void luaw_getfield(lua_State* L, int index, std::string const& field)
 {
-    std::istringstream iss(field);
-    std::string property;
-
     int top = lua_gettop(L);
 
     lua_pushvalue(L, index);
 
-    while (std::getline(iss, property, '.')) {
-        lua_getfield(L, -1, property.c_str());
-        int type = lua_type(L, -1);
-        if (type == LUA_TNIL || (iss.peek() != EOF /* is not last */ && type != LUA_TTABLE)) {
-            lua_settop(L, top);
-            return false;
-        }
+    if (!luaw_walkfield(L, field, true)) {
+        lua_settop(L, top);
+        luaL_error(L, "Field '%s' not found.", field.c_str());
     }
+}
 
+bool luaw_hasfield(lua_State* L, int index, std::string const& field)
+{
+    int top = lua_gettop(L);
+
+    lua_pushvalue(L, index);
+    bool found = luaw_walkfield(L, field, true);
     lua_settop(L, top);
-    return true;
+
+    return found;
 }
 
 void luaw_setfield(lua_State* L, int index, std::string const& field)
 {
-    std::istringstream iss(field);
-    std::string property;
-    std::vector<std::string> ps;
-
-    while (std::getline(iss, property, '.'))
-        ps.push_back(property);
-
     int top = lua_gettop(L);
-    int levels = 0;
 
     lua_pushvalue(L, index);
 
-    for (size_t i = 0; i < ps.size() - 1; ++i) {
-        lua_getfield(L, -1, ps.at(i).c_str());
-        int type = lua_type(L, -1);
-        if (type == LUA_TNIL || (iss.peek() != EOF /* is not last */ && type != LUA_TTABLE)) {
-            lua_settop(L, top);
-            luaL_error(L, "Field '%s' not found.", field.c_str());
-        }
-        ++levels;
+    if (!luaw_walkfield(L, field, false)) {
+        lua_settop(L, top);
+        luaL_error(L, "Field '%s' not found.", field.c_str());
     }
 
-    lua_pushvalue(L, - levels - 2);
-    lua_setfield(L, -2, ps.at(ps.size() - 1).c_str());
+    size_t dot = field.rfind('.');
+    std::string_view last = (dot == std::string::npos) ? std::string_view(field) : std::string_view(field).substr(dot + 1);
+
+    lua_pushlstring(L, last.data(), last.size());
+    lua_pushvalue(L, top);
+    lua_settable(L, -3);
 
     lua_settop(L, top - 1);
 }
 
+LuaFieldPath::LuaFieldPath(std::string const& path)
+    : path_(path), segments_(path)
+{
+    if (path.empty() || path.front() == '.' || path.back() == '.' || path.find("..") != std::string::npos)
+        throw std::runtime_error("Invalid field path '" + path + "' (empty segment)");
+
+    offsets_.push_back(0);
+    for (size_t i = 0; i < segments_.size(); ++i) {
+        if (segments_[i] == '.') {
+            segments_[i] = '\0';
+            offsets_.push_back(i + 1);
+        }
+    }
+}
+
 std::string luaw_to_string(lua_State* L, int index)
 {
     lua_getglobal(L, "tostring");
@@ -325,3 +2087,12 @@ std::string luaw_to_string(lua_State* L, int index)
     lua_call(L, 1, 1);
     return luaw_pop<std::string>(L);
 }
+
+void luaw_push_globals(lua_State* L)
+{
+#if LUAW == JIT
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#else
+    lua_pushglobaltable(L);
+#endif
+}
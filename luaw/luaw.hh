@@ -1,10 +1,17 @@
 #ifndef LUAW_HH_
 #define LUAW_HH_
 
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <stdexcept>
 
@@ -16,18 +23,246 @@ extern "C" {
 #endif
 }
 
+// initialization
+
+struct LuaStateOptions {
+    bool   pool_allocator = false;   // allocate small blocks from size-class pools, released in bulk by `luaw_close`
+    size_t memory_limit = 0;         // bytes, 0 = unlimited (allocations over the limit raise a memory error)
+    bool   strict = true;            // globals must be declared in the main chunk (see `luaw_check_globals`)
+    size_t chunk_cache = 0;          // compiled chunks kept by `luaw_do` (least recently used are evicted), 0 = none
+
+    std::string_view bytecode_cache_dir {};   // where `luaw_dofile` keeps compiled files, empty = no cache (copied by
+                                              //   `luaw_newstate`: must outlive the pools/executors using the options)
+};
+
+struct LuaAllocStats {
+    size_t bytes_in_use = 0;
+    size_t peak_bytes = 0;
+    size_t allocations = 0;
+    size_t frees = 0;
+    size_t reallocations = 0;
+    size_t large_allocations = 0;   // blocks too large for the pools, allocated with `malloc`
+    size_t chunks = 0;              // pool chunks allocated
+    size_t chunk_bytes = 0;
+    size_t limit_failures = 0;      // allocations refused because of `memory_limit`
+};
+
+struct LuaMemoryStats {
+    size_t live = 0;         // bytes allocated by the state
+    size_t peak = 0;         // 0 if the state doesn't use the luaw allocator (see `LuaStateOptions`)
+    size_t limit = 0;        // 0 = unlimited
+    size_t gc_debt = 0;      // bytes allocated since the end of the last GC cycle (with the default allocator,
+                             //   since the first call to `luaw_memory` after the cycle)
+    size_t gc_cycles = 0;    // GC cycles completed
+};
+
 lua_State* luaw_newstate();
+lua_State* luaw_newstate(LuaStateOptions const& options);   // nullptr if `memory_limit` is too low (or, on LuaJIT, if
+                                                            //   custom allocators are unsupported: `pool_allocator`
+                                                            //   alone then falls back to the default allocator)
+void       luaw_close(lua_State* L);   // use instead of `lua_close` for states created with options
+
+std::optional<LuaAllocStats> luaw_alloc_stats(lua_State* L);   // empty if the state doesn't use the luaw allocator
+LuaMemoryStats               luaw_memory(lua_State* L);
+bool                         luaw_set_memory_limit(lua_State* L, size_t limit);   // false if the state doesn't use the luaw allocator
+
+// garbage collection
+
+enum class LuaGcMode { Incremental, Generational };
+
+struct LuaGcStats {
+    LuaGcMode                 mode = LuaGcMode::Incremental;
+    size_t                    pauses = 0;           // calls to `luaw_gc_step` and `luaw_gc_collect`
+    size_t                    cycles_completed = 0; // cycles completed by these calls
+    std::chrono::microseconds last_pause {};
+    std::chrono::microseconds max_pause {};
+    std::chrono::microseconds total_pause {};
+};
+
+bool       luaw_gc_mode(lua_State* L, LuaGcMode mode);                      // false if not supported (LuaJIT: incremental only)
+bool       luaw_gc_step(lua_State* L, std::chrono::microseconds budget);   // incremental steps within the budget, true if a cycle completed
+void       luaw_gc_collect(lua_State* L);                                   // full collection
+LuaGcStats luaw_gc_stats(lua_State* L);
+
+// strict mode: statically check the use of globals in a chunk (only reports, the state is not changed)
+
+bool luaw_check_globals(lua_State* L, std::string_view code, std::vector<std::string>* errors=nullptr);
+
+// like `luaw_do`, for trusted chunks: the chunk must pass `luaw_check_globals` (otherwise an error is raised), and
+// then runs without the runtime checks (including the code it calls)
+void luaw_do_checked(lua_State* L, std::string const& buffer, int nresults=0, std::string const& name="anonymous");
+
+// execution budget: while a guard is alive, code running in the state is aborted with an error once the budget
+// is spent (checked by a count hook, every 1000 VM instructions at most)
+
+struct LuaBudget {
+    size_t                    instructions = 0;   // VM instructions, 0 = unlimited
+    std::chrono::microseconds time {};            // wall time, 0 = unlimited
+};
+
+class LuaBudgetGuard {
+public:
+    LuaBudgetGuard(lua_State* L, LuaBudget const& budget);
+    ~LuaBudgetGuard();   // restores the previous budget (guards can be nested) or hook
+
+    LuaBudgetGuard(LuaBudgetGuard const&) = delete;
+    LuaBudgetGuard& operator=(LuaBudgetGuard const&) = delete;
+
+    [[nodiscard]] bool exceeded() const;
+
+private:
+    struct Saved {
+        bool                                  active = false;
+        bool                                  exceeded = false;
+        size_t                                instructions = 0;
+        std::chrono::steady_clock::time_point deadline {};
+    };
+
+    lua_State* L_;
+    lua_Hook   previous_hook_;
+    int        previous_mask_;
+    int        previous_count_;
+    Saved      previous_ {};
+};
+
+bool luaw_budget_exceeded(lua_State* L);   // true if the budget of the current guard was exceeded
+
+// sampling profiler: samples the call stack every N instructions or every interval of time, and aggregates
+// the samples as folded stacks (input of flamegraph.pl, speedscope, etc.)
+
+struct LuaProfilerConfig {
+    int                       instructions = 0;   // sample every N VM instructions, or...
+    std::chrono::microseconds interval {};        // ...every interval (checked every 1000 instructions), default 10 ms
+    size_t                    max_depth = 64;
+};
+
+class LuaProfiler {
+public:
+    explicit LuaProfiler(lua_State* L, LuaProfilerConfig const& config = {});   // starts sampling
+    ~LuaProfiler();
+
+    LuaProfiler(LuaProfiler const&) = delete;
+    LuaProfiler& operator=(LuaProfiler const&) = delete;
+
+    void stop();
+
+    [[nodiscard]] std::string folded() const;    // one line per stack: "main@chunk;f@chunk:12;g@chunk:20 42"
+    [[nodiscard]] size_t      samples() const;
+    void                      clear();
+
+private:
+    friend void luaw_hook(lua_State* L, lua_Debug* ar);
+
+    int  on_hook(lua_State* L);   // returns the number of instructions until the next call
+    void sample(lua_State* L);
+
+    lua_State*                            L_;
+    LuaProfilerConfig                     config_;
+    std::chrono::steady_clock::time_point next_sample_;
+    mutable std::mutex                    mutex_;
+    std::map<std::string, size_t>         stacks_;
+    size_t                                samples_ = 0;
+};
 
 // file loading
 
 void luaw_do(lua_State* L, uint8_t* data, size_t sz, int nresults=0, std::string const& name="anonymous");
 void luaw_do(lua_State* L, std::string const& buffer, int nresults=0, std::string const& name="anonymous");
 void luaw_dofile(lua_State* L, std::string const& filename, int nresults=0, std::string const& name="anonymous");
+void luaw_set_bytecode_cache(lua_State* L, std::string const& dir);   // see `LuaStateOptions::bytecode_cache_dir`
 
 void luaw_do_z(lua_State* L, struct LuaCompressedBytecode lcb[], bool keep_results=false);
+void luaw_register_z(lua_State* L, struct LuaCompressedBytecode lcb[]);   // chunks loaded on demand by `require`
 
 template <typename T> T luaw_do(lua_State* L, std::string const& buffer, std::string const& name="anonymous");
 
+// parallel loading: the sources are compiled on worker threads, then run in order in `L` (errors are raised
+// like `luaw_do`, and the sources after the one that failed are not run)
+
+struct LuaSource {
+    std::string code {};        // source code, or...
+    std::string filename {};    // ...file to read
+    std::string name {};        // chunk name (default: the file name, or "anonymous")
+};
+
+void luaw_do_parallel(lua_State* L, std::vector<LuaSource> const& sources, unsigned threads=0);   // 0 = one per core
+
+// bytecode archives: a single file written by `luazh -a`, mapped in memory, with chunks loaded by name
+
+struct LuaArchiveHeader {       // followed by the entries (sorted by name), then the names and data
+    char     magic[8] {};       // "LUAWARC" + version
+    uint32_t count = 0;
+    uint32_t reserved = 0;
+};
+
+struct LuaArchiveEntry {        // offsets are from the start of the file
+    uint64_t name_offset = 0;
+    uint64_t data_offset = 0;
+    uint64_t size = 0;          // size in the archive
+    uint64_t uncompressed = 0;  // size of the bytecode if compressed, 0 if stored as is
+    uint32_t name_len = 0;
+    uint32_t crc32 = 0;         // of the data in the archive
+};
+
+inline constexpr char luaw_archive_magic[8] = { 'L', 'U', 'A', 'W', 'A', 'R', 'C', 1 };
+
+class LuaArchive {
+public:
+    explicit LuaArchive(std::string const& path);   // throws std::runtime_error if the archive is invalid
+
+    LuaArchive(LuaArchive const&) = delete;
+    LuaArchive& operator=(LuaArchive const&) = delete;
+
+    void reload();                           // map the file again (after it was replaced)
+    void reload(std::string const& path);    // swap to another archive; on error, the current one is kept
+
+    void load(lua_State* L, std::string const& name) const;                  // push the chunk function
+    void run(lua_State* L, std::string const& name, int nresults=0) const;   // like `luaw_do`
+
+    [[nodiscard]] bool                     contains(std::string const& name) const;
+    [[nodiscard]] std::vector<std::string> names() const;
+    [[nodiscard]] std::string              path() const;
+
+private:
+    struct Mapping;
+    static std::shared_ptr<const Mapping> map(std::string const& path);
+    [[nodiscard]] std::shared_ptr<const Mapping> mapping() const;
+
+    mutable std::mutex             mutex_;
+    std::string                    path_;
+    std::shared_ptr<const Mapping> mapping_;   // loads in progress keep the previous mapping alive during a swap
+};
+
+// compiled chunks: compile once, run many times
+
+class LuaChunk {
+public:
+    LuaChunk(lua_State* L, std::string_view code, std::string const& name="anonymous");   // raises syntax errors like `luaw_do`
+    ~LuaChunk();
+
+    LuaChunk(LuaChunk const&) = delete;
+    LuaChunk& operator=(LuaChunk const&) = delete;
+    LuaChunk(LuaChunk&& other) noexcept;
+    LuaChunk& operator=(LuaChunk&& other) noexcept;
+
+    void                  push() const;                   // push the chunk function
+    void                  run(int nresults=0) const;      // like `luaw_do`
+    template <typename T> T run() const;
+
+private:
+    lua_State* L_;
+    int        ref_;
+};
+
+struct LuaChunkCacheStats {
+    size_t entries = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+void               luaw_set_chunk_cache(lua_State* L, size_t entries);   // see `LuaStateOptions::chunk_cache`
+LuaChunkCacheStats luaw_chunk_cache_stats(lua_State* L);
+
 // dump
 
 std::string luaw_dump(lua_State* L, int index, bool pretty_print=true, size_t max_depth=3, size_t current_depth=0);
@@ -38,6 +273,7 @@ void luaw_print_stack(lua_State* L, size_t max_depth=3);
 
 void luaw_ensure(lua_State* L, int expected_sz=0);
 int luaw_len(lua_State* L, int index);
+int luaw_absindex(lua_State* L, int index);
 
 // stack management
 
@@ -48,7 +284,10 @@ template <typename T> T luaw_to(lua_State* L, int index);
 template <typename T> T luaw_to(lua_State* L, int index, T const& default_);
 template <typename T> T luaw_pop(lua_State* L);
 
+template <typename T> std::optional<T> luaw_try_to(lua_State* L, int index, std::string* error=nullptr);
+
 template <typename T> T luaw_to_(lua_State* L, int index);  // TODO
+template <typename T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error);
 
 int luaw_push(lua_State* L, lua_CFunction f);
 
@@ -58,6 +297,18 @@ template<typename T, typename... Args>             T*   luaw_push_new_userdata(l
 
 struct WrappedUserdata { void* object; };
 
+// struct descriptors (see `lua_fields` in README)
+
+template <typename T, typename M>
+struct LuaField {
+    const char* name;
+    M T::*      member;
+};
+
+template <typename T, typename M> constexpr LuaField<T, M> luaw_field(const char* name, M T::* member) { return { name, member }; }
+
+#define LUAW_FIELD(type, member) luaw_field(#member, &type::member)
+
 // globals
 
 template <typename T> T    luaw_getglobal(lua_State* L, std::string const& global);
@@ -66,7 +317,8 @@ template <typename T> void luaw_setglobal(lua_State* L, std::string const& globa
 // iteration
 
 template <typename F> requires std::invocable<F&, lua_State*, int>         void luaw_ipairs(lua_State* L, int index, F fn);
-template <typename F> requires std::invocable<F&, lua_State*, std::string> void luaw_spairs(lua_State* L, int index, F fn);
+template <typename F> requires std::invocable<F&, lua_State*, std::string> || std::invocable<F&, lua_State*, std::string_view>
+void luaw_spairs(lua_State* L, int index, F fn);
 template <typename F> requires std::invocable<F&, lua_State*>              void luaw_pairs(lua_State* L, int index, F fn);
 
 // fields
@@ -78,6 +330,63 @@ void luaw_setfield(lua_State* L, int index, std::string const& field);
 template <typename T> T luaw_getfield(lua_State* L, int index, std::string const& field);
 template <typename T> void luaw_setfield(lua_State* L, int index, std::string const& field, T const& t);
 
+// precompiled field paths (split once, no parsing or allocation on each access)
+
+template <typename P>
+concept FieldPath = requires(P const& p, size_t i) {
+    { p.size() } -> std::convertible_to<size_t>;
+    { p[i] } -> std::same_as<const char*>;
+    { p.c_str() } -> std::same_as<const char*>;
+};
+
+class LuaFieldPath {
+public:
+    explicit LuaFieldPath(std::string const& path);   // throws std::runtime_error if the path or a segment is empty
+
+    [[nodiscard]] size_t      size() const { return offsets_.size(); }
+    [[nodiscard]] const char* operator[](size_t i) const { return segments_.data() + offsets_[i]; }
+    [[nodiscard]] const char* c_str() const { return path_.c_str(); }
+
+private:
+    std::string         path_;
+    std::string         segments_;   // path with '.' replaced by '\0'
+    std::vector<size_t> offsets_;
+};
+
+template <size_t N>
+struct LuaStaticFieldPath {   // split at compile time: `static constexpr LuaStaticFieldPath path("a.b.c");`
+    consteval LuaStaticFieldPath(const char (&path_)[N]) {
+        if (N <= 1 || path_[0] == '.' || path_[N - 2] == '.')
+            throw "empty field path segment";   // compile-time error
+        offsets[n++] = 0;
+        for (size_t i = 0; i < N; ++i) {
+            path[i] = path_[i];
+            segments[i] = (path_[i] == '.') ? '\0' : path_[i];
+            if (path_[i] == '.') {
+                if (path_[i + 1] == '.')
+                    throw "empty field path segment";
+                offsets[n++] = i + 1;
+            }
+        }
+    }
+
+    [[nodiscard]] constexpr size_t      size() const { return n; }
+    [[nodiscard]] constexpr const char* operator[](size_t i) const { return segments + offsets[i]; }
+    [[nodiscard]] constexpr const char* c_str() const { return path; }
+
+    char   path[N] {};
+    char   segments[N] {};
+    size_t offsets[N] {};
+    size_t n = 0;
+};
+
+template <FieldPath P> void luaw_getfield(lua_State* L, int index, P const& path);
+template <FieldPath P> bool luaw_hasfield(lua_State* L, int index, P const& path);
+template <FieldPath P> void luaw_setfield(lua_State* L, int index, P const& path);
+
+template <typename T, FieldPath P> T luaw_getfield(lua_State* L, int index, P const& path);
+template <FieldPath P, typename T> void luaw_setfield(lua_State* L, int index, P const& path, T const& t);
+
 // calls
 
 template <typename T=nullptr_t> T luaw_call(lua_State* L, auto&&... args);
@@ -88,6 +397,35 @@ int luaw_call_push(lua_State* L, int nresults, auto&&... args);
 int luaw_call_push_global(lua_State* L, std::string const& global, int nresults, auto&&... args);
 int luaw_call_push_field(lua_State* L, int index, std::string const& field, int nresults, auto&&... args);
 
+// function handles (resolved once, pinned in the registry)
+
+template <typename Signature> class LuaFunction;
+
+template <typename R, typename... Args>
+class LuaFunction<R(Args...)> {
+public:
+    LuaFunction(lua_State* L, int index);                                    // function on the stack
+    LuaFunction(lua_State* L, std::string const& global);
+    template <FieldPath P> LuaFunction(lua_State* L, int index, P const& path);
+    ~LuaFunction();
+
+    LuaFunction(LuaFunction const&) = delete;
+    LuaFunction& operator=(LuaFunction const&) = delete;
+    LuaFunction(LuaFunction&& other) noexcept;
+    LuaFunction& operator=(LuaFunction&& other) noexcept;
+
+    R operator()(Args const&... args) const;
+
+    [[nodiscard]] lua_State* state() const { return L_; }
+    [[nodiscard]] int        ref() const { return ref_; }
+
+private:
+    void pin(std::string const& description);
+
+    lua_State* L_ = nullptr;
+    int        ref_ = LUA_NOREF;
+};
+
 // metatables
 
 using LuaMetatable = std::map<std::string, lua_CFunction>;
@@ -96,6 +434,7 @@ template<typename T> std::string luaw_set_metatable(lua_State* L, LuaMetatable c
 // other
 
 std::string luaw_to_string(lua_State* L, int index);
+void luaw_push_globals(lua_State* L);
 
 #include "luaw.inl"
 
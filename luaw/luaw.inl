@@ -4,6 +4,7 @@
 #include <memory>
 #include <optional>
 #include <map>
+#include <ranges>
 #include <unordered_map>
 #include <tuple>
 
@@ -44,18 +45,37 @@ concept Optional = requires( T t )
 };
 
 template <typename T>
-concept Iterable = requires(T t) {
-    begin(t);
-    end(t);
-    t.push_back(typename T::value_type{});
-    requires !std::is_same_v<T, std::string>;
+concept StringView =     // points into a Lua string: only valid while the string is on the stack
+    std::same_as<T, std::string_view> || std::same_as<T, std::span<const std::byte>> ||
+    (Optional<T> && (std::same_as<typename T::value_type, std::string_view> || std::same_as<typename T::value_type, std::span<const std::byte>>));
+
+template <typename T>
+concept NumericSequence = requires(T t) {     // contiguous containers of numbers (vector<double>, array<int, N>, span<float>...)
+    requires std::ranges::contiguous_range<T>;
+    requires std::ranges::sized_range<T>;
+    requires std::is_arithmetic_v<std::ranges::range_value_t<T>>;
+    requires !std::same_as<std::ranges::range_value_t<T>, bool>;
+    requires !std::same_as<std::ranges::range_value_t<T>, char>;
 };
 
+template <typename T>
+concept FixedSizeSequence = requires { std::tuple_size<T>::value; };
+
 template<typename T>
 concept MapType =
     std::same_as<T, std::map<typename T::key_type, typename T::mapped_type, typename T::key_compare, typename T::allocator_type>> ||
     std::same_as<T, std::unordered_map<typename T::key_type, typename T::mapped_type, typename T::hasher, typename T::key_equal, typename T::allocator_type>>;
 
+template <typename T>
+concept Iterable = requires(T t) {     // sequences (push_back) and sets (insert)
+    begin(t);
+    end(t);
+    requires requires { t.push_back(typename T::value_type{}); } || requires { t.insert(typename T::value_type{}); };
+    requires !std::is_same_v<T, std::string>;
+    requires !NumericSequence<T>;
+    requires !MapType<T>;
+};
+
 
 template<class T, std::size_t N>
 concept has_tuple_element =
@@ -65,7 +85,7 @@ requires(T t) {
 };
 
 template<class T>
-concept Tuple = !std::is_reference_v<T> && requires(T t) {
+concept Tuple = !std::is_reference_v<T> && !NumericSequence<T> && requires(T t) {
     typename std::tuple_size<T>::type;
     requires std::derived_from<
             std::tuple_size<T>,
@@ -90,6 +110,11 @@ concept ComparableToLua = requires(T t) {
     { &T::lua_is };
 };
 
+template <typename T>
+concept ReflectedToLua = requires {
+    std::tuple_size<std::remove_cv_t<decltype(T::lua_fields)>>::value;
+};
+
 //
 // PRIVATE - metatable identifier
 //
@@ -107,6 +132,54 @@ const char* mt_identifier() {
         return typeid(std::remove_pointer_t<T>).name();
 }
 
+//
+// PRIVATE - conversion errors
+//
+
+template <typename T>
+std::string cpp_type_name() {
+    std::string cpp_type = typeid(T).name();
+
+    int status = -4;
+    std::unique_ptr<char, void(*)(void*)> res {
+            abi::__cxa_demangle(cpp_type.c_str(), NULL, NULL, &status),
+            std::free
+    };
+
+    if (status == 0)
+        cpp_type = res.get();
+    return cpp_type;
+}
+
+template <typename T>
+void luaw_set_type_error(lua_State* L, int index, std::string* error) {
+    if (error)
+        *error = "expected C++ type `" + cpp_type_name<T>() + "`, actual lua type is `" + lua_typename(L, lua_type(L, index))
+               + "` (" + luaw_dump(L, index, false) + ")";
+}
+
+inline void luaw_prefix_error(std::string* error, std::string const& where) {   // where: "[2]", ".name"...
+    if (!error)
+        return;
+    if (!error->empty() && (error->front() == '[' || error->front() == '.'))
+        *error = where + *error;
+    else
+        *error = where + ": " + *error;
+}
+
+// raise a Lua error describing why the value at `index` can't be converted to T
+template <typename T>
+void luaw_type_error(lua_State* L, int index) {
+    {
+        std::string error;
+        luaw_try_to_<T>(L, index, &error);
+        luaL_where(L, 1);
+        lua_pushfstring(L, "Type unexpected (%s)", error.c_str());
+    }
+    lua_concat(L, 2);
+    lua_error(L);
+}
+
 //
 // CODE LOADING
 //
@@ -117,6 +190,12 @@ template <typename T> T luaw_do(lua_State* L, std::string const& buffer, std::st
     return luaw_pop<T>(L);
 }
 
+template <typename T> T LuaChunk::run() const
+{
+    run(1);
+    return luaw_pop<T>(L_);
+}
+
 //
 // STACK MANAGEMENT
 //
@@ -131,26 +210,31 @@ template <typename T> T luaw_to(lua_State* L, int index, T const& default_)
 
 template <typename T> T luaw_to(lua_State* L, int index)
 {
-    if (!luaw_is<T>(L, index)) {
-        std::string cpp_type = typeid(T).name();
-
-        int status = -4;
-        std::unique_ptr<char, void(*)(void*)> res {
-                abi::__cxa_demangle(cpp_type.c_str(), NULL, NULL, &status),
-                std::free
-        };
+    std::optional<T> t = luaw_try_to_<T>(L, index, nullptr);
+    if (!t)
+        luaw_type_error<T>(L, index);
+    return std::move(*t);
+}
 
-        if (status == 0)
-            cpp_type = res.get();
+template <typename T> std::optional<T> luaw_try_to(lua_State* L, int index, std::string* error)
+{
+    return luaw_try_to_<T>(L, index, error);
+}
 
-        luaL_error(L, "Type unexpected (expected C++ type `%s`, actual lua type is `%s` (%s))",
-                   cpp_type.c_str(), lua_typename(L, lua_type(L, index)), luaw_dump(L, index, false).c_str());
+// Check and convert. This generic version checks the type with `luaw_is` and then converts it - containers
+// override it to validate and convert in a single pass.
+template <typename T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error)
+{
+    if (!luaw_is<T>(L, index)) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
     }
     return luaw_to_<T>(L, index);
 }
 
 template <typename T> T luaw_pop(lua_State* L)
 {
+    static_assert(!StringView<T>, "views of Lua strings are only valid while the string is on the stack: use std::string (or luaw_to)");
     T t = (T) luaw_to<T>(L, -1);
     lua_pop(L, 1);
     return t;
@@ -246,7 +330,10 @@ template <PointerType T> T luaw_to_(lua_State* L, int index)
 // table (vector, set...)
 
 template <Iterable T> int luaw_push(lua_State* L, T const& t) {
-    lua_newtable(L);
+    if constexpr (std::ranges::sized_range<T>)
+        lua_createtable(L, (int) std::ranges::size(t), 0);
+    else
+        lua_newtable(L);
     int i = 1;
     for (auto const& v : t) {
         luaw_push(L, v);
@@ -255,13 +342,106 @@ template <Iterable T> int luaw_push(lua_State* L, T const& t) {
     return 1;
 }
 template <Iterable T> bool luaw_is(lua_State* L, int index) { return lua_istable(L, index); }
-template <Iterable T> T luaw_to_(lua_State* L, int index) {
-    luaL_checktype(L, index, LUA_TTABLE);
+template <Iterable T> T luaw_to_(lua_State* L, int index) { return luaw_to<T>(L, index); }
+template <Iterable T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error) {
+    static_assert(!StringView<typename T::value_type>, "views of Lua strings are only valid while the string is on the stack: use std::string");
+    if (!lua_istable(L, index)) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
+    }
     T ts;
     int sz = luaw_len(L, index);
+    if constexpr (requires { ts.reserve(sz); })
+        ts.reserve(sz);
+    for (int i = 1; i <= sz; ++i) {
+        lua_rawgeti(L, index, i);
+        auto v = luaw_try_to_<typename T::value_type>(L, -1, error);
+        lua_pop(L, 1);
+        if (!v) {
+            luaw_prefix_error(error, "[" + std::to_string(i) + "]");
+            return {};
+        }
+        if constexpr (requires { ts.push_back(std::move(*v)); })
+            ts.push_back(std::move(*v));
+        else
+            ts.insert(std::move(*v));
+    }
+    return ts;
+}
+
+// numeric sequences (vector<double>, array<int, N>, span<float>...): presized, converted in a tight loop
+
+template <NumericSequence T> int luaw_push(lua_State* L, T const& t) {
+    using V = std::ranges::range_value_t<T>;
+    const V* data = std::ranges::data(t);
+    int sz = (int) std::ranges::size(t);
+    lua_createtable(L, sz, 0);
+    for (int i = 0; i < sz; ++i) {
+        if constexpr (std::is_integral_v<V>)
+            lua_pushinteger(L, (lua_Integer) data[i]);
+        else
+            lua_pushnumber(L, (lua_Number) data[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+template <NumericSequence T> bool luaw_is(lua_State* L, int index) {
+    if constexpr (FixedSizeSequence<T>) {
+        if (!lua_istable(L, index) || luaw_len(L, index) != (int) std::tuple_size_v<T>)
+            return false;
+        for (int i = 1; i <= (int) std::tuple_size_v<T>; ++i) {
+            lua_rawgeti(L, index, i);
+            bool is = lua_isnumber(L, -1);
+            lua_pop(L, 1);
+            if (!is)
+                return false;
+        }
+        return true;
+    } else {
+        return lua_istable(L, index);
+    }
+}
+
+template <NumericSequence T> requires FixedSizeSequence<T> || requires(T t) { t.resize(0); }
+T luaw_to_(lua_State* L, int index) { return luaw_to<T>(L, index); }
+
+template <NumericSequence T> requires FixedSizeSequence<T> || requires(T t) { t.resize(0); }
+std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error) {
+    using V = std::ranges::range_value_t<T>;
+    if (!lua_istable(L, index)) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
+    }
+    int sz = luaw_len(L, index);
+
+    T ts {};
+    if constexpr (FixedSizeSequence<T>) {
+        if (sz != (int) std::tuple_size_v<T>) {
+            if (error)
+                *error = "expected a table of size " + std::to_string(std::tuple_size_v<T>) + ", actual size is " + std::to_string(sz);
+            return {};
+        }
+    } else {
+        ts.resize(sz);
+    }
+
+    V* data = std::ranges::data(ts);
     for (int i = 1; i <= sz; ++i) {
         lua_rawgeti(L, index, i);
-        ts.push_back(luaw_to<typename T::value_type>(L, -1));
+        int isnum;
+        if constexpr (std::is_integral_v<V>) {
+            isnum = lua_isnumber(L, -1);
+            data[i - 1] = (V) lua_tointeger(L, -1);   // same conversion as `luaw_to<int>`
+        } else {
+            data[i - 1] = (V) lua_tonumberx(L, -1, &isnum);
+        }
+        if (!isnum) {
+            if (error)
+                *error = "[" + std::to_string(i) + "]: expected a number, actual lua type is `" + lua_typename(L, lua_type(L, -1)) + "`";
+            lua_pop(L, 1);
+            return {};
+        }
         lua_pop(L, 1);
     }
     return ts;
@@ -287,6 +467,14 @@ template <Optional T> T luaw_to_(lua_State* L, int index) {
     else
         return luaw_to<typename T::value_type>(L, index);
 }
+template <Optional T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error) {
+    if (index > lua_gettop(L) || lua_isnil(L, index))
+        return std::optional<T>(std::in_place);   // an empty T, converted successfully
+    auto v = luaw_try_to_<typename T::value_type>(L, index, error);
+    if (!v)
+        return {};
+    return T { std::move(*v) };
+}
 
 // tuple
 
@@ -337,10 +525,41 @@ template <Tuple T> T luaw_to_(lua_State* L, int index)
     return t;
 }
 
+template <Tuple T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error)
+{
+    static_assert(![]<std::size_t... I>(std::index_sequence<I...>) {
+        return (StringView<std::tuple_element_t<I, T>> || ...);
+    }(std::make_index_sequence<std::tuple_size_v<T>>{}), "views of Lua strings are only valid while the string is on the stack: use std::string");
+    if (lua_type(L, index) != LUA_TTABLE || luaw_len(L, index) != std::tuple_size_v<T>) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
+    }
+
+    T t;
+    index = luaw_absindex(L, index);
+    bool ok = [&]<std::size_t... I>(std::index_sequence<I...>) {
+        return ([&] {
+            lua_rawgeti(L, index, I + 1);
+            auto v = luaw_try_to_<std::tuple_element_t<I, T>>(L, -1, error);
+            lua_pop(L, 1);
+            if (!v) {
+                luaw_prefix_error(error, "[" + std::to_string(I + 1) + "]");
+                return false;
+            }
+            std::get<I>(t) = std::move(*v);
+            return true;
+        }() && ...);
+    }(std::make_index_sequence<std::tuple_size_v<T>>());
+
+    if (!ok)
+        return {};
+    return t;
+}
+
 // map
 
 template <MapType T> int luaw_push(lua_State* L, T const& t) {
-    lua_newtable(L);
+    lua_createtable(L, 0, (int) t.size());
     for (auto const& kv: t) {
         luaw_push(L, kv.first);
         luaw_push(L, kv.second);
@@ -366,13 +585,34 @@ template <MapType T> bool luaw_is(lua_State* L, int index) {
     return is;
 }
 
-template <MapType T> T luaw_to_(lua_State* L, int index) {
+template <MapType T> T luaw_to_(lua_State* L, int index) { return luaw_to<T>(L, index); }
+
+template <MapType T> std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error) {
+    static_assert(!StringView<typename T::key_type> && !StringView<typename T::mapped_type>, "views of Lua strings are only valid while the string is on the stack: use std::string");
+    if (lua_type(L, index) != LUA_TTABLE) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
+    }
+
     T t;
-    luaw_pairs(L, index, [&t](lua_State* L) {
-        auto key = luaw_to<typename T::key_type>(L, -2);
-        auto value = luaw_to<typename T::mapped_type>(L, -1);
-        t[key] = value;
-    });
+    lua_pushvalue(L, index);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);   // convert a copy of the key, so `lua_next` doesn't see it changed into a string
+        auto key = luaw_try_to_<typename T::key_type>(L, -1, error);
+        lua_pop(L, 1);
+        std::optional<typename T::mapped_type> value;
+        if (key)
+            value = luaw_try_to_<typename T::mapped_type>(L, -1, error);
+        if (!key || !value) {
+            luaw_prefix_error(error, "[" + luaw_dump(L, -2, false) + "]");
+            lua_pop(L, 3);
+            return {};
+        }
+        t.insert_or_assign(std::move(*key), std::move(*value));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
     return t;
 }
 
@@ -395,6 +635,103 @@ template <ComparableToLua T> bool luaw_is(lua_State*L, int index)
     return T::lua_is(L, index);
 }
 
+// struct objects described by `lua_fields`
+
+template <ReflectedToLua T>
+void luaw_push_field_names(lua_State* L)
+{
+    // the field names are interned once per state, and kept in the registry as an array of strings
+    static const char registry_key = 0;
+    constexpr size_t n_fields = std::tuple_size_v<std::remove_cv_t<decltype(T::lua_fields)>>;
+
+    lua_pushlightuserdata(L, (void *) &registry_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, n_fields, 0);
+        int i = 1;
+        std::apply([&](auto const&... field) { ((lua_pushstring(L, field.name), lua_rawseti(L, -2, i++)), ...); }, T::lua_fields);
+        lua_pushlightuserdata(L, (void *) &registry_key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+}
+
+template <ReflectedToLua T> requires (!PushableToLua<T>) int luaw_push(lua_State* L, T const& t)
+{
+    constexpr size_t n_fields = std::tuple_size_v<std::remove_cv_t<decltype(T::lua_fields)>>;
+
+    lua_createtable(L, 0, n_fields);
+    luaw_push_field_names<T>(L);
+    int i = 1;
+    std::apply([&](auto const&... field) {
+        ((lua_rawgeti(L, -1, i++), luaw_push(L, t.*(field.member)), lua_rawset(L, -4)), ...);
+    }, T::lua_fields);
+    lua_pop(L, 1);
+
+    luaL_setmetatable(L, mt_identifier<T>());
+    return 1;
+}
+
+template <ReflectedToLua T> requires (!ComparableToLua<T>) bool luaw_is(lua_State* L, int index)
+{
+    if (!lua_istable(L, index))
+        return false;
+
+    index = luaw_absindex(L, index);
+    luaw_push_field_names<T>(L);
+    int i = 1;
+    bool is = std::apply([&](auto const&... field) {
+        return ([&] {
+            using M = std::remove_cvref_t<decltype(std::declval<T>().*(field.member))>;
+            lua_rawgeti(L, -1, i++);
+            lua_gettable(L, index);
+            bool field_is = luaw_is<M>(L, -1);
+            lua_pop(L, 1);
+            return field_is;
+        }() && ...);
+    }, T::lua_fields);
+    lua_pop(L, 1);
+
+    return is;
+}
+
+template <ReflectedToLua T> requires (!ConvertibleToLua<T>) T luaw_to_(lua_State* L, int index) { return luaw_to<T>(L, index); }
+
+template <ReflectedToLua T> requires (!ConvertibleToLua<T>) std::optional<T> luaw_try_to_(lua_State* L, int index, std::string* error)
+{
+    if (!lua_istable(L, index)) {
+        luaw_set_type_error<T>(L, index, error);
+        return {};
+    }
+
+    T t {};
+    index = luaw_absindex(L, index);
+    luaw_push_field_names<T>(L);
+    int i = 1;
+    bool ok = std::apply([&](auto const&... field) {
+        return ([&] {
+            using M = std::remove_cvref_t<decltype(t.*(field.member))>;
+            static_assert(!StringView<M>, "views of Lua strings are only valid while the string is on the stack: use std::string");
+            lua_rawgeti(L, -1, i++);
+            lua_gettable(L, index);
+            auto v = luaw_try_to_<M>(L, -1, error);
+            lua_pop(L, 1);
+            if (!v) {
+                luaw_prefix_error(error, std::string(".") + field.name);
+                return false;
+            }
+            t.*(field.member) = std::move(*v);
+            return true;
+        }() && ...);
+    }, T::lua_fields);
+    lua_pop(L, 1);
+
+    if (!ok)
+        return {};
+    return t;
+}
+
 /*
 // variant
 
@@ -458,15 +795,19 @@ void luaw_ipairs(lua_State* L, int index, F fn)
     lua_pop(L, 1);
 }
 
-template <typename F> requires std::invocable<F&, lua_State*, std::string>
+template <typename F> requires std::invocable<F&, lua_State*, std::string> || std::invocable<F&, lua_State*, std::string_view>
 void luaw_spairs(lua_State* L, int index, F fn)
 {
     lua_pushvalue(L, index);   // clone the table
 
     lua_pushnil(L);
     while (lua_next(L, -2) != 0) {
-        if (lua_type(L, -2) == LUA_TSTRING)
-            fn(L, luaw_to<std::string>(L, -2));
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            if constexpr (std::invocable<F&, lua_State*, std::string_view>)
+                fn(L, luaw_to_<std::string_view>(L, -2));   // key stays on the stack during the call
+            else
+                fn(L, luaw_to_<std::string>(L, -2));
+        }
         lua_pop(L, 1);
     }
 
@@ -505,6 +846,87 @@ template <typename T> void luaw_setfield(lua_State* L, int index, std::string co
     luaw_setfield(L, index - 1, field);
 }
 
+template <FieldPath P> void luaw_getfield(lua_State* L, int index, P const& path)
+{
+    if (path.size() == 0)
+        luaL_error(L, "Empty field path.");
+
+    int top = lua_gettop(L);
+
+    lua_pushvalue(L, index);
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        lua_getfield(L, -1, path[i]);
+        int type = lua_type(L, -1);
+        if (type == LUA_TNIL || (i + 1 < path.size() /* is not last */ && type != LUA_TTABLE)) {
+            lua_settop(L, top);
+            luaL_error(L, "Field '%s' not found.", path.c_str());
+        }
+        lua_replace(L, -2);
+    }
+}
+
+template <FieldPath P> bool luaw_hasfield(lua_State* L, int index, P const& path)
+{
+    if (path.size() == 0)
+        return false;
+
+    int top = lua_gettop(L);
+
+    lua_pushvalue(L, index);
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        lua_getfield(L, -1, path[i]);
+        int type = lua_type(L, -1);
+        if (type == LUA_TNIL || (i + 1 < path.size() /* is not last */ && type != LUA_TTABLE)) {
+            lua_settop(L, top);
+            return false;
+        }
+        lua_replace(L, -2);
+    }
+
+    lua_settop(L, top);
+    return true;
+}
+
+template <FieldPath P> void luaw_setfield(lua_State* L, int index, P const& path)
+{
+    if (path.size() == 0)
+        luaL_error(L, "Empty field path.");
+
+    int top = lua_gettop(L);
+
+    lua_pushvalue(L, index);
+
+    for (size_t i = 0; i + 1 < path.size(); ++i) {
+        lua_getfield(L, -1, path[i]);
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_settop(L, top);
+            luaL_error(L, "Field '%s' not found.", path.c_str());
+        }
+        lua_replace(L, -2);
+    }
+
+    lua_pushvalue(L, top);
+    lua_setfield(L, -2, path[path.size() - 1]);
+
+    lua_settop(L, top - 1);
+}
+
+template <typename T, FieldPath P> T luaw_getfield(lua_State* L, int index, P const& path)
+{
+    luaw_getfield(L, index, path);
+    T t = luaw_to<T>(L, -1);
+    lua_pop(L, 1);
+    return t;
+}
+
+template <FieldPath P, typename T> void luaw_setfield(lua_State* L, int index, P const& path, T const& t)
+{
+    luaw_push(L, t);
+    luaw_setfield(L, index - 1, path);
+}
+
 //
 // CALLS
 //
@@ -551,6 +973,87 @@ int luaw_call_push_field(lua_State* L, int index, std::string const& field, int
     return nresults;
 }
 
+//
+// FUNCTION HANDLES
+//
+
+template <typename R, typename... Args>
+void LuaFunction<R(Args...)>::pin(std::string const& description)
+{
+    if (lua_type(L_, -1) != LUA_TFUNCTION) {
+        lua_pop(L_, 1);
+        luaL_error(L_, "'%s' is not a function", description.c_str());
+    }
+    ref_ = luaL_ref(L_, LUA_REGISTRYINDEX);
+}
+
+template <typename R, typename... Args>
+LuaFunction<R(Args...)>::LuaFunction(lua_State* L, int index)
+    : L_(L)
+{
+    lua_pushvalue(L, index);
+    pin("value at index " + std::to_string(index));
+}
+
+template <typename R, typename... Args>
+LuaFunction<R(Args...)>::LuaFunction(lua_State* L, std::string const& global)
+    : L_(L)
+{
+    lua_getglobal(L, global.c_str());
+    pin(global);
+}
+
+template <typename R, typename... Args>
+template <FieldPath P>
+LuaFunction<R(Args...)>::LuaFunction(lua_State* L, int index, P const& path)
+    : L_(L)
+{
+    luaw_getfield(L, index, path);
+    pin(path.c_str());
+}
+
+template <typename R, typename... Args>
+LuaFunction<R(Args...)>::~LuaFunction()
+{
+    if (L_)
+        luaL_unref(L_, LUA_REGISTRYINDEX, ref_);
+}
+
+template <typename R, typename... Args>
+LuaFunction<R(Args...)>::LuaFunction(LuaFunction&& other) noexcept
+    : L_(other.L_), ref_(other.ref_)
+{
+    other.L_ = nullptr;
+    other.ref_ = LUA_NOREF;
+}
+
+template <typename R, typename... Args>
+LuaFunction<R(Args...)>& LuaFunction<R(Args...)>::operator=(LuaFunction&& other) noexcept
+{
+    if (this != &other) {
+        if (L_)
+            luaL_unref(L_, LUA_REGISTRYINDEX, ref_);
+        L_ = other.L_;
+        ref_ = other.ref_;
+        other.L_ = nullptr;
+        other.ref_ = LUA_NOREF;
+    }
+    return *this;
+}
+
+template <typename R, typename... Args>
+R LuaFunction<R(Args...)>::operator()(Args const&... args) const
+{
+    lua_rawgeti(L_, LUA_REGISTRYINDEX, ref_);
+    (luaw_push(L_, args), ...);
+    if constexpr (std::is_void_v<R>) {
+        lua_call(L_, sizeof...(Args), 0);
+    } else {
+        lua_call(L_, sizeof...(Args), 1);
+        return luaw_pop<R>(L_);
+    }
+}
+
 //
 // METATABLE
 //
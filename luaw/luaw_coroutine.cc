@@ -0,0 +1,161 @@
+#include "luaw_coroutine.hh"
+
+#include <algorithm>
+
+//
+// TASKS
+//
+
+std::coroutine_handle<> LuaTaskPromiseBase::finished(std::coroutine_handle<> self) noexcept
+{
+    if (continuation)
+        return continuation;
+    if (loop)
+        loop->finished(self, exception);
+    return std::noop_coroutine();
+}
+
+//
+// EVENT LOOP
+//
+
+LuaEventLoop::~LuaEventLoop()
+{
+    for (auto h : spawned_)
+        h.destroy();
+}
+
+void LuaEventLoop::post(std::coroutine_handle<> h)
+{
+    {
+        std::lock_guard lock(mutex_);
+        ready_.push_back(h);
+    }
+    wakeup_.notify_one();
+}
+
+void LuaEventLoop::add_timer(clock::time_point when, std::coroutine_handle<> h)
+{
+    {
+        std::lock_guard lock(mutex_);
+        timers_.push({ when, timer_seq_++, h });
+    }
+    wakeup_.notify_one();
+}
+
+void LuaEventLoop::finished(std::coroutine_handle<> h, std::exception_ptr exception)
+{
+    // called from the task's final suspend point - the frame is destroyed later, in `run`
+    if (exception && !exception_)
+        exception_ = exception;
+    finished_.push_back(h);
+}
+
+size_t LuaEventLoop::tasks() const
+{
+    std::lock_guard lock(mutex_);
+    return spawned_.size();
+}
+
+void LuaEventLoop::run()
+{
+    std::unique_lock lock(mutex_);
+
+    while (!spawned_.empty() || !ready_.empty()) {
+        auto now = clock::now();
+        while (!timers_.empty() && timers_.top().when <= now) {
+            ready_.push_back(timers_.top().h);
+            timers_.pop();
+        }
+
+        if (ready_.empty()) {
+            // nothing to do: wait for the next timer, or for a task to be posted from another thread
+            if (timers_.empty())
+                wakeup_.wait(lock);
+            else
+                wakeup_.wait_until(lock, timers_.top().when);
+            continue;
+        }
+
+        auto h = ready_.front();
+        ready_.pop_front();
+
+        lock.unlock();
+        h.resume();
+        lock.lock();
+
+        for (auto f : finished_) {
+            spawned_.erase(std::find(spawned_.begin(), spawned_.end(), f));
+            f.destroy();
+        }
+        finished_.clear();
+    }
+
+    if (exception_)
+        std::rethrow_exception(std::exchange(exception_, nullptr));
+}
+
+//
+// LUA COROUTINES
+//
+
+LuaCoroutine::LuaCoroutine(LuaEventLoop& loop, lua_State* L)
+    : loop_(&loop), L_(L)
+{
+    T_ = lua_newthread(L);          // keep a reference to the thread, so it's not collected
+    lua_insert(L, -2);
+    lua_xmove(L, T_, 1);            // move the function to the new thread
+    ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+LuaCoroutine::LuaCoroutine(LuaEventLoop& loop, lua_State* L, std::string const& global)
+    : loop_(&loop), L_(L)
+{
+    T_ = lua_newthread(L);
+    lua_getglobal(L, global.c_str());
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        lua_pop(L, 2);
+        throw std::runtime_error("Global '" + global + "' is not a function");
+    }
+    lua_xmove(L, T_, 1);
+    ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+LuaCoroutine::LuaCoroutine(LuaCoroutine&& other) noexcept
+    : loop_(other.loop_), L_(other.L_), T_(other.T_), ref_(std::exchange(other.ref_, LUA_NOREF)), done_(other.done_)
+{
+}
+
+LuaCoroutine::~LuaCoroutine()
+{
+    if (ref_ != LUA_NOREF)
+        luaL_unref(L_, LUA_REGISTRYINDEX, ref_);
+}
+
+int LuaCoroutine::resume_(int nargs)
+{
+    if (done_) {
+        lua_pop(T_, nargs);
+        throw std::runtime_error("Cannot resume a dead coroutine");
+    }
+
+#if LUAW == JIT
+    int status = lua_resume(T_, nargs);
+    int nres = lua_gettop(T_);
+#else
+    int nres = 0;
+    int status = lua_resume(T_, L_, nargs, &nres);
+#endif
+
+    if (status == LUA_YIELD)
+        return nres;
+
+    done_ = true;
+    if (status == LUA_OK)
+        return nres;
+
+    const char* msg = lua_tostring(T_, -1);
+    std::string error = msg ? msg : "Unknown Lua error";
+    lua_settop(T_, 0);
+    throw std::runtime_error("Runtime error: " + error);
+}
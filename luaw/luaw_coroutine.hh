@@ -0,0 +1,251 @@
+#ifndef LUAW_COROUTINE_HH_
+#define LUAW_COROUTINE_HH_
+
+#include "luaw.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class LuaEventLoop;
+
+//
+// TASKS
+//
+
+// C++ coroutine type for code driving Lua coroutines. Tasks are lazy: they start when awaited by another task,
+// or when spawned on an event loop.
+template <typename T=void> class LuaTask;
+
+struct LuaTaskPromiseBase {
+    struct FinalAwaiter {
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().finished(h);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter        final_suspend() const noexcept { return {}; }
+    void                unhandled_exception() { exception = std::current_exception(); }
+
+    std::coroutine_handle<> finished(std::coroutine_handle<> self) noexcept;   // resume the awaiter, or notify the loop
+
+    std::coroutine_handle<> continuation;            // task awaiting this one
+    LuaEventLoop*           loop = nullptr;          // set when spawned
+    std::exception_ptr      exception;
+};
+
+template <typename T>
+struct LuaTaskPromise : LuaTaskPromiseBase {
+    LuaTask<T> get_return_object();
+    void return_value(T value_) { value.emplace(std::move(value_)); }
+
+    T result() {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct LuaTaskPromise<void> : LuaTaskPromiseBase {
+    LuaTask<void> get_return_object();
+    void return_void() const {}
+
+    void result() const {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+template <typename T>
+class LuaTask {
+public:
+    using promise_type = LuaTaskPromise<T>;
+
+    explicit LuaTask(std::coroutine_handle<promise_type> h) : h_(h) {}
+    LuaTask(LuaTask const&) = delete;
+    LuaTask& operator=(LuaTask const&) = delete;
+    LuaTask(LuaTask&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+    LuaTask& operator=(LuaTask&& other) noexcept { if (this != &other) { reset(); h_ = std::exchange(other.h_, {}); } return *this; }
+    ~LuaTask() { reset(); }
+
+    // awaiting a task starts it, and resumes the awaiter when it's done
+    [[nodiscard]] bool      await_ready() const noexcept { return h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept { h_.promise().continuation = awaiter; return h_; }
+    T                       await_resume() { return h_.promise().result(); }
+
+    [[nodiscard]] bool done() const { return h_.done(); }
+
+private:
+    friend class LuaEventLoop;
+    void reset() { if (h_) h_.destroy(); h_ = {}; }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T> LuaTask<T> LuaTaskPromise<T>::get_return_object() { return LuaTask<T> { std::coroutine_handle<LuaTaskPromise<T>>::from_promise(*this) }; }
+inline LuaTask<void> LuaTaskPromise<void>::get_return_object() { return LuaTask<void> { std::coroutine_handle<LuaTaskPromise<void>>::from_promise(*this) }; }
+
+//
+// EVENT LOOP
+//
+
+// Single-threaded scheduler: all tasks spawned on a loop (and the Lua states they use) run in the thread
+// calling `run`. Use one loop (and one Lua state) per thread to spread the work over several threads.
+class LuaEventLoop {
+public:
+    using clock = std::chrono::steady_clock;
+
+    LuaEventLoop() = default;
+    ~LuaEventLoop();   // destroys tasks that didn't finish
+
+    LuaEventLoop(LuaEventLoop const&) = delete;
+    LuaEventLoop& operator=(LuaEventLoop const&) = delete;
+
+    template <typename T> void spawn(LuaTask<T> task);   // the loop takes ownership of the task
+
+    void run();   // run until all spawned tasks are done; rethrows the first exception that escaped a task
+
+    void post(std::coroutine_handle<> h);   // schedule `h` to be resumed in the loop (can be called from any thread)
+
+    // awaitables
+    [[nodiscard]] auto schedule()                     { return Awaiter { this, {} }; }              // continue in the loop thread
+    [[nodiscard]] auto sleep_for(clock::duration d)   { return Awaiter { this, clock::now() + d }; }
+    [[nodiscard]] auto sleep_until(clock::time_point t) { return Awaiter { this, t }; }
+
+    [[nodiscard]] size_t tasks() const;   // spawned tasks not yet done
+
+private:
+    friend struct LuaTaskPromiseBase;
+
+    struct Awaiter {
+        LuaEventLoop*                    loop;
+        std::optional<clock::time_point> when;
+
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) const { if (when) loop->add_timer(*when, h); else loop->post(h); }
+        void await_resume() const noexcept {}
+    };
+
+    struct Timer {
+        clock::time_point       when;
+        uint64_t                seq;     // keeps timers with the same deadline in order
+        std::coroutine_handle<> h;
+        bool operator>(Timer const& other) const { return std::tie(when, seq) > std::tie(other.when, other.seq); }
+    };
+
+    void add_timer(clock::time_point when, std::coroutine_handle<> h);
+    void finished(std::coroutine_handle<> h, std::exception_ptr exception);
+
+    mutable std::mutex                                              mutex_;
+    std::condition_variable                                         wakeup_;
+    std::deque<std::coroutine_handle<>>                             ready_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>>  timers_;
+    uint64_t                                                        timer_seq_ = 0;
+    std::vector<std::coroutine_handle<>>                            spawned_;    // owned by the loop
+    std::vector<std::coroutine_handle<>>                            finished_;   // to be destroyed
+    std::exception_ptr                                              exception_;
+};
+
+template <typename T> void LuaEventLoop::spawn(LuaTask<T> task)
+{
+    auto h = std::exchange(task.h_, {});
+    h.promise().loop = this;
+    {
+        std::lock_guard lock(mutex_);
+        spawned_.push_back(h);
+    }
+    post(h);
+}
+
+//
+// LUA COROUTINES
+//
+
+// A Lua thread (`lua_newthread`) running a function. Each `co_await co.resume<T>(args...)` pushes `args` with
+// `luaw_push`, resumes the Lua coroutine from the event loop, and converts the first value yielded (or
+// returned) to `T`. Lua errors are thrown as `std::runtime_error`.
+class LuaCoroutine {
+public:
+    LuaCoroutine(LuaEventLoop& loop, lua_State* L);                              // pops the function from the stack
+    LuaCoroutine(LuaEventLoop& loop, lua_State* L, std::string const& global);
+    ~LuaCoroutine();
+
+    LuaCoroutine(LuaCoroutine const&) = delete;
+    LuaCoroutine& operator=(LuaCoroutine const&) = delete;
+    LuaCoroutine(LuaCoroutine&& other) noexcept;
+    LuaCoroutine& operator=(LuaCoroutine&& other) = delete;
+
+    template <typename T=nullptr_t, typename... Args> [[nodiscard]] auto resume(Args const&... args);
+
+    [[nodiscard]] bool       done() const { return done_; }   // returned or raised an error
+    [[nodiscard]] lua_State* thread() const { return T_; }
+
+private:
+    template <typename T, typename... Args> struct ResumeAwaiter;
+
+    int resume_(int nargs);   // returns the number of values yielded/returned
+
+    LuaEventLoop* loop_;
+    lua_State*    L_;
+    lua_State*    T_;
+    int           ref_;
+    bool          done_ = false;
+};
+
+template <typename T, typename... Args>
+struct LuaCoroutine::ResumeAwaiter {
+    LuaCoroutine*       co;
+    std::tuple<Args...> args;
+
+    // the Lua coroutine runs when the loop resumes the awaiting task, so many Lua coroutines are interleaved
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const { co->loop_->post(h); }
+
+    T await_resume() {
+        lua_State* th = co->T_;
+        std::apply([th](auto const&... a) { (luaw_push(th, a), ...); }, args);
+        int nres = co->resume_(sizeof...(Args));
+
+        if constexpr (std::is_same_v<T, nullptr_t>) {
+            lua_pop(th, nres);
+            return nullptr;
+        } else {
+            if (nres == 0) {
+                lua_pushnil(th);
+                nres = 1;
+            }
+            std::string error;
+            std::optional<T> t = luaw_try_to<T>(th, -nres, &error);
+            lua_pop(th, nres);
+            if (!t)
+                throw std::runtime_error(error);
+            return std::move(*t);
+        }
+    }
+};
+
+template <typename T, typename... Args> auto LuaCoroutine::resume(Args const&... args)
+{
+    return ResumeAwaiter<T, std::decay_t<Args>...> { this, { args... } };
+}
+
+#endif //LUAW_COROUTINE_HH_
@@ -0,0 +1,159 @@
+#include "luaw_executor.hh"
+
+using namespace std::string_literals;
+
+//
+// JOB QUEUE
+//
+
+void LuaJobQueue::push(LuaJob* job)
+{
+    job->next.store(nullptr, std::memory_order_relaxed);
+    LuaJob* prev = head_.exchange(job, std::memory_order_acq_rel);
+    prev->next.store(job, std::memory_order_release);
+}
+
+LuaJob* LuaJobQueue::pop()
+{
+    LuaJob* tail = tail_;
+    LuaJob* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &stub_) {
+        if (next == nullptr)
+            return nullptr;
+        tail_ = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+
+    if (tail != head_.load(std::memory_order_acquire))
+        return nullptr;   // a producer is in the middle of a push
+
+    push(&stub_);
+
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+//
+// EXECUTOR
+//
+
+LuaExecutor::LuaExecutor(LuaExecutorConfig config)
+    : config_(std::move(config))
+{
+    size_t n = config_.threads ? config_.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < n; ++i)
+        workers_.push_back(std::make_unique<Worker>());
+    for (auto& worker : workers_)
+        worker->thread = std::thread([this, w = worker.get()] { run_worker(*w); });
+}
+
+LuaExecutor::~LuaExecutor()
+{
+    stopping_.store(true, std::memory_order_release);
+    for (size_t i = 0; i < workers_.size(); ++i)
+        wake(i);
+    for (auto& worker : workers_)
+        worker->thread.join();
+}
+
+void LuaExecutor::enqueue(size_t worker, LuaJob* job, bool wake_worker)
+{
+    workers_[worker]->queue.push(job);
+    if (wake_worker)
+        wake(worker);
+}
+
+void LuaExecutor::wake(size_t worker)
+{
+    Worker& w = *workers_[worker];
+    w.signal.fetch_add(1, std::memory_order_release);
+    w.signal.notify_one();
+}
+
+static int run_job(lua_State* L)
+{
+    auto job = (LuaJob *) lua_touserdata(L, 1);
+    lua_pop(L, 1);
+    job->run(L);
+    return 0;
+}
+
+// runs the initialization in protected mode: an error fails the jobs of the worker instead of the whole process
+static int run_init(lua_State* L)   // config
+{
+    auto config = (LuaExecutorConfig const *) lua_touserdata(L, 1);
+    lua_pop(L, 1);
+    bool failed = false;
+    try {
+        if (!config->init_script.empty())
+            luaw_do(L, config->init_script, 0, "executor_init");
+        if (config->init_bytecode)
+            luaw_do_z(L, config->init_bytecode);
+        if (config->init)
+            config->init(L);
+    } catch (std::exception const& e) {   // other exceptions are left alone (LuaJIT errors are C++ exceptions)
+        lua_pushstring(L, e.what());
+        failed = true;
+    }
+    if (failed)
+        lua_error(L);
+    return 0;
+}
+
+void LuaExecutor::run_worker(Worker& worker)
+{
+    // each worker owns its state: it's created and only ever used in this thread
+
+    std::string error = "Could not create Lua state (memory limit too low?)";
+    lua_State* L = luaw_newstate(config_.state);
+    if (L) {
+        lua_pushcfunction(L, run_init);
+        lua_pushlightuserdata(L, (void *) &config_);
+        if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+            const char* msg = lua_tostring(L, -1);
+            error = "Error initializing Lua state: "s + (msg ? msg : "Unknown Lua error");
+            luaw_close(L);
+            L = nullptr;
+        }
+    }
+
+    for (;;) {
+        uint32_t signal = worker.signal.load(std::memory_order_acquire);
+        bool stopping = stopping_.load(std::memory_order_acquire);   // read before draining the queue
+
+        while (LuaJob* job = worker.queue.pop()) {
+            if (!L) {   // the jobs of this worker fail, instead of the whole process
+                job->fail(error);
+                delete job;
+                continue;
+            }
+            lua_settop(L, 0);
+            lua_pushcfunction(L, run_job);
+            lua_pushlightuserdata(L, job);
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                const char* msg = lua_tostring(L, -1);
+                job->fail(msg ? msg : "Unknown Lua error");
+            }
+            delete job;
+        }
+
+        if (stopping)
+            break;
+
+        worker.signal.wait(signal, std::memory_order_acquire);
+    }
+
+    if (L)
+        luaw_close(L);
+}
@@ -0,0 +1,207 @@
+#ifndef LUAW_EXECUTOR_HH_
+#define LUAW_EXECUTOR_HH_
+
+#include "luaw.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//
+// JOBS
+//
+
+struct LuaJob {
+    virtual ~LuaJob() = default;
+    virtual void run(lua_State* L) = 0;                 // called in protected mode on the worker state
+    virtual void fail(std::string const& message) = 0;  // called if `run` raised a Lua error
+
+    std::atomic<LuaJob*> next { nullptr };
+};
+
+template <typename F, typename R>
+struct LuaFutureJob : LuaJob {
+    explicit LuaFutureJob(F&& f) : f(std::move(f)) {}
+
+    void run(lua_State* L) override {
+        try {
+            if constexpr (std::is_void_v<R>) {
+                f(L);
+                promise.set_value();
+            } else {
+                promise.set_value(f(L));
+            }
+        } catch (std::exception const&) {   // other exceptions are left alone (LuaJIT errors are C++ exceptions)
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    void fail(std::string const& message) override {
+        promise.set_exception(std::make_exception_ptr(std::runtime_error(message)));
+    }
+
+    F                f;
+    std::promise<R>  promise;
+};
+
+// Intrusive multiple-producer single-consumer queue (D. Vyukov). Pushing is wait-free, popping is done
+// only by the worker that owns the queue.
+class LuaJobQueue {
+public:
+    LuaJobQueue() : head_(&stub_), tail_(&stub_) {}
+
+    void    push(LuaJob* job);
+    LuaJob* pop();
+
+private:
+    struct Stub : LuaJob {
+        void run(lua_State*) override {}
+        void fail(std::string const&) override {}
+    };
+
+    Stub                 stub_;
+    std::atomic<LuaJob*> head_;
+    LuaJob*              tail_;
+};
+
+//
+// EXECUTOR
+//
+
+struct LuaExecutorConfig {
+    size_t threads = 0;                                           // 0 = std::thread::hardware_concurrency()
+
+    LuaStateOptions                 state {};                     // options for `luaw_newstate`
+    std::string                     init_script {};               // run on each worker state
+    struct LuaCompressedBytecode*   init_bytecode = nullptr;      // run on each worker state (see `luaw_do_z`)
+    std::function<void(lua_State*)> init {};                      // run on each worker state, after the above
+};
+
+class LuaExecutor {
+public:
+    explicit LuaExecutor(LuaExecutorConfig config = {});
+    ~LuaExecutor();   // runs the jobs already submitted, then stops the workers
+
+    LuaExecutor(LuaExecutor const&) = delete;
+    LuaExecutor& operator=(LuaExecutor const&) = delete;
+
+    // run `f(lua_State*)` on any worker (or, with a key, always on the same worker)
+    template <typename F> auto submit(F f);
+    template <typename F> auto submit(size_t key, F f);
+
+    // submit several jobs at once (waking up each worker only once)
+    template <typename F> auto submit_batch(std::vector<F> fs);
+    template <typename F> auto submit_batch(size_t key, std::vector<F> fs);
+
+    // call a global function, converting the result to T (see `luaw_call_global`)
+    template <typename T=nullptr_t> std::future<T> call(std::string const& global, auto... args);
+    template <typename T=nullptr_t> std::future<T> call_keyed(size_t key, std::string const& global, auto... args);
+
+    [[nodiscard]] size_t threads() const { return workers_.size(); }
+
+private:
+    struct Worker {
+        LuaJobQueue           queue;
+        std::atomic<uint32_t> signal { 0 };
+        std::thread           thread;
+    };
+
+    template <typename F> auto make_job(F&& f);
+    void enqueue(size_t worker, LuaJob* job, bool wake=true);
+    void wake(size_t worker);
+    void run_worker(Worker& worker);
+
+    LuaExecutorConfig                    config_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t>                  next_ { 0 };
+    std::atomic<bool>                    stopping_ { false };
+};
+
+template <typename F> auto LuaExecutor::make_job(F&& f)
+{
+    using R = std::invoke_result_t<F&, lua_State*>;
+    auto job = std::make_unique<LuaFutureJob<F, R>>(std::move(f));
+    auto future = job->promise.get_future();
+    return std::make_pair(std::move(job), std::move(future));
+}
+
+template <typename F> auto LuaExecutor::submit(F f)
+{
+    return submit(next_.fetch_add(1, std::memory_order_relaxed), std::move(f));
+}
+
+template <typename F> auto LuaExecutor::submit(size_t key, F f)
+{
+    auto [job, future] = make_job(std::move(f));
+    enqueue(key % workers_.size(), job.release());
+    return std::move(future);
+}
+
+template <typename F> auto LuaExecutor::submit_batch(std::vector<F> fs)
+{
+    using R = std::invoke_result_t<F&, lua_State*>;
+    std::vector<std::future<R>> futures;
+    futures.reserve(fs.size());
+
+    size_t first = next_.fetch_add(fs.size(), std::memory_order_relaxed);
+    for (size_t i = 0; i < fs.size(); ++i) {
+        auto [job, future] = make_job(std::move(fs[i]));
+        enqueue((first + i) % workers_.size(), job.release(), false);
+        futures.push_back(std::move(future));
+    }
+    for (size_t i = 0; i < std::min(fs.size(), workers_.size()); ++i)
+        wake((first + i) % workers_.size());
+
+    return futures;
+}
+
+template <typename F> auto LuaExecutor::submit_batch(size_t key, std::vector<F> fs)
+{
+    using R = std::invoke_result_t<F&, lua_State*>;
+    std::vector<std::future<R>> futures;
+    futures.reserve(fs.size());
+
+    for (F& f : fs) {
+        auto [job, future] = make_job(std::move(f));
+        enqueue(key % workers_.size(), job.release(), false);
+        futures.push_back(std::move(future));
+    }
+    wake(key % workers_.size());
+
+    return futures;
+}
+
+// the arguments are copied into the job, which runs later: strings are copied, so they can't dangle
+template <typename A> auto luaw_job_arg(A a)
+{
+    if constexpr (std::is_same_v<A, const char*> || std::is_same_v<A, char*> || std::is_same_v<A, std::string_view>)
+        return std::string(a);
+    else
+        return a;
+}
+
+template <typename T> std::future<T> LuaExecutor::call(std::string const& global, auto... args)
+{
+    return submit([global, ...args = luaw_job_arg(std::move(args))](lua_State* L) {
+        return luaw_call_global<T>(L, global, args...);
+    });
+}
+
+template <typename T> std::future<T> LuaExecutor::call_keyed(size_t key, std::string const& global, auto... args)
+{
+    return submit(key, [global, ...args = luaw_job_arg(std::move(args))](lua_State* L) {
+        return luaw_call_global<T>(L, global, args...);
+    });
+}
+
+#endif //LUAW_EXECUTOR_HH_
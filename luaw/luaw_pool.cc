@@ -0,0 +1,303 @@
+#include "luaw_pool.hh"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using namespace std::string_literals;
+
+LuaStatePool::LuaStatePool(LuaStatePoolConfig config)
+    : config_(std::move(config))
+{
+    try {
+        for (size_t i = 0; i < config_.initial_size; ++i)
+            idle_.push_back(create());
+    } catch (...) {   // the destructor is not called
+        for (Entry& entry : idle_)
+            close(entry);
+        throw;
+    }
+}
+
+LuaStatePool::~LuaStatePool()
+{
+    for (Entry& entry : idle_)
+        close(entry);
+}
+
+// runs the initialization in protected mode: errors are reported instead of going to the panic handler
+static int run_init(lua_State* L)   // config
+{
+    auto config = (LuaStatePoolConfig const *) lua_touserdata(L, 1);
+    lua_pop(L, 1);
+    bool failed = false;
+    try {
+        if (!config->init_script.empty())
+            luaw_do(L, config->init_script, 0, "pool_init");
+        if (config->init_bytecode)
+            luaw_do_z(L, config->init_bytecode);
+        if (config->init)
+            config->init(L);
+    } catch (std::exception const& e) {   // other exceptions are left alone (LuaJIT errors are C++ exceptions)
+        lua_pushstring(L, e.what());
+        failed = true;
+    }
+    if (failed)
+        lua_error(L);
+    return 0;
+}
+
+// returns a reference to a shallow copy of the table at `index` (LUA_NOREF if it's not a table)
+static int snapshot(lua_State* L, int index)
+{
+    index = luaw_absindex(L, index);
+    if (!lua_istable(L, index))
+        return LUA_NOREF;
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// restores the fields of the table at `index` from a snapshot
+static void restore(lua_State* L, int index, int snapshot_ref)
+{
+    if (snapshot_ref == LUA_NOREF || !lua_istable(L, index))
+        return;
+    index = luaw_absindex(L, index);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, snapshot_ref);
+    int snapshot = lua_gettop(L);
+
+    // fields that were created or changed: restore the snapshot value (or nil). Assigning to existing
+    // fields is allowed during a traversal.
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, snapshot);
+        if (!lua_rawequal(L, -1, -2)) {
+            lua_pushvalue(L, -3);
+            lua_insert(L, -2);
+            lua_rawset(L, index);
+        } else {
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    // fields that were removed
+    lua_pushnil(L);
+    while (lua_next(L, snapshot) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, index);
+        bool missing = lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (missing) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, index);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
+// pushes the globals and the strict mode declarations (or nil)
+static void push_globals_and_declared(lua_State* L)
+{
+    luaw_push_globals(L);
+    if (lua_getmetatable(L, -1)) {
+        lua_getfield(L, -1, "__declared");
+        lua_remove(L, -2);
+    } else {
+        lua_pushnil(L);
+    }
+}
+
+LuaStatePool::Entry LuaStatePool::create() const
+{
+    Entry entry;
+    lua_State* L = entry.L = luaw_newstate(config_.state);
+    if (!L)
+        throw std::runtime_error("Could not create Lua state (memory limit too low?)");
+
+    lua_pushcfunction(L, run_init);
+    lua_pushlightuserdata(L, (void *) &config_);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        const char* msg = lua_tostring(L, -1);
+        std::string error = "Error initializing Lua state: "s + (msg ? msg : "Unknown Lua error");
+        luaw_close(L);
+        throw std::runtime_error(error);
+    }
+
+    lua_settop(L, 0);
+
+    // keep a shallow copy of the globals (and of the declared globals), so they can be restored when the state
+    // is returned to the pool
+
+    push_globals_and_declared(L);
+    entry.declared_ref = snapshot(L, -1);
+    entry.globals_ref = snapshot(L, -2);
+    lua_settop(L, 0);
+
+    entry.owner = std::this_thread::get_id();
+    return entry;
+}
+
+void LuaStatePool::reset(Entry& entry) const
+{
+    lua_State* L = entry.L;
+
+    lua_settop(L, 0);
+    push_globals_and_declared(L);
+    restore(L, 1, entry.globals_ref);
+    restore(L, 2, entry.declared_ref);
+
+    lua_settop(L, 0);
+    lua_gc(L, LUA_GCSTEP, config_.gc_step_kb);
+}
+
+void LuaStatePool::close(Entry& entry)
+{
+    luaw_close(entry.L);
+    entry.L = nullptr;
+}
+
+LuaStatePool::Entry LuaStatePool::take_idle()
+{
+    // prefer the state last used by this thread (its memory is more likely to be in this core's cache),
+    // otherwise the most recently released one
+    auto self = std::this_thread::get_id();
+    auto it = idle_.end() - 1;
+    for (auto jt = idle_.rbegin(); jt != idle_.rend(); ++jt) {
+        if (jt->owner == self) {
+            it = jt.base() - 1;
+            break;
+        }
+    }
+
+    Entry entry = *it;
+    idle_.erase(it);
+    return entry;
+}
+
+LuaStatePool::Handle LuaStatePool::acquire()
+{
+    std::unique_lock lock(mutex_);
+    available_.wait(lock, [this] {
+        return !idle_.empty() || config_.max_size == 0 || idle_.size() + in_use_ + creating_ < config_.max_size;
+    });
+
+    if (!idle_.empty()) {
+        ++in_use_;
+        return { this, take_idle() };
+    }
+
+    return { this, create_in_use(lock) };
+}
+
+std::optional<LuaStatePool::Handle> LuaStatePool::try_acquire()
+{
+    std::unique_lock lock(mutex_);
+
+    if (!idle_.empty()) {
+        ++in_use_;
+        return Handle { this, take_idle() };
+    }
+
+    if (config_.max_size != 0 && idle_.size() + in_use_ + creating_ >= config_.max_size)
+        return {};
+
+    return Handle { this, create_in_use(lock) };
+}
+
+// creates a new state outside of the lock, and counts it as in use
+LuaStatePool::Entry LuaStatePool::create_in_use(std::unique_lock<std::mutex>& lock)
+{
+    ++creating_;
+    lock.unlock();
+    Entry entry;
+    try {
+        entry = create();
+    } catch (...) {
+        lock.lock();
+        --creating_;
+        available_.notify_one();
+        throw;
+    }
+    lock.lock();
+    --creating_;
+    ++in_use_;
+    return entry;
+}
+
+void LuaStatePool::release(Entry entry)
+{
+    reset(entry);
+    entry.owner = std::this_thread::get_id();
+
+    {
+        std::lock_guard lock(mutex_);
+        --in_use_;
+        if (config_.max_idle == 0 || idle_.size() < config_.max_idle) {
+            idle_.push_back(entry);
+            entry.L = nullptr;
+        }
+    }
+    available_.notify_one();
+
+    if (entry.L)
+        close(entry);
+}
+
+void LuaStatePool::shrink(size_t keep_idle)
+{
+    std::vector<Entry> to_close;
+    {
+        std::lock_guard lock(mutex_);
+        while (idle_.size() > keep_idle) {
+            to_close.push_back(idle_.front());   // oldest first
+            idle_.erase(idle_.begin());
+        }
+    }
+    available_.notify_all();
+
+    for (Entry& entry : to_close)
+        close(entry);
+}
+
+size_t LuaStatePool::size() const
+{
+    std::lock_guard lock(mutex_);
+    return idle_.size() + in_use_;
+}
+
+size_t LuaStatePool::idle() const
+{
+    std::lock_guard lock(mutex_);
+    return idle_.size();
+}
+
+LuaStatePool::Handle& LuaStatePool::Handle::operator=(Handle&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        entry_ = other.entry_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+void LuaStatePool::Handle::release()
+{
+    if (pool_) {
+        pool_->release(entry_);
+        pool_ = nullptr;
+    }
+}
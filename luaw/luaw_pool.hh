@@ -0,0 +1,90 @@
+#ifndef LUAW_POOL_HH_
+#define LUAW_POOL_HH_
+
+#include "luaw.hh"
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LuaStatePoolConfig {
+    size_t initial_size = 0;    // states created when the pool is created
+    size_t max_size = 0;        // maximum number of states (idle + in use), 0 = unlimited
+    size_t max_idle = 0;        // idle states kept when a state is released, 0 = unlimited
+
+    LuaStateOptions                 state {};                  // options for `luaw_newstate`
+    std::string                     init_script {};            // run on each new state
+    struct LuaCompressedBytecode*   init_bytecode = nullptr;   // run on each new state (see `luaw_do_z`)
+    std::function<void(lua_State*)> init {};                   // run on each new state, after the above
+
+    int gc_step_kb = 0;         // on release, perform an incremental GC step of this size (0 = basic step)
+};
+
+class LuaStatePool {
+    struct Entry {
+        lua_State*      L = nullptr;
+        int             globals_ref = LUA_NOREF;   // snapshot of the globals after initialization
+        int             declared_ref = LUA_NOREF;  // snapshot of the declared globals (strict mode)
+        std::thread::id owner;                     // last thread that used this state
+    };
+
+public:
+    class Handle {
+    public:
+        Handle(Handle const&) = delete;
+        Handle& operator=(Handle const&) = delete;
+        Handle(Handle&& other) noexcept : pool_(other.pool_), entry_(other.entry_) { other.pool_ = nullptr; }
+        Handle& operator=(Handle&& other) noexcept;
+        ~Handle() { release(); }
+
+        [[nodiscard]] lua_State* get() const { return entry_.L; }
+        operator lua_State*() const { return entry_.L; }
+
+        void release();   // return the state to the pool (also done by the destructor)
+
+    private:
+        friend class LuaStatePool;
+        Handle(LuaStatePool* pool, Entry entry) : pool_(pool), entry_(entry) {}
+
+        LuaStatePool* pool_;
+        Entry         entry_;
+    };
+
+    explicit LuaStatePool(LuaStatePoolConfig config = {});
+    ~LuaStatePool();   // all handles must have been released
+
+    LuaStatePool(LuaStatePool const&) = delete;
+    LuaStatePool& operator=(LuaStatePool const&) = delete;
+
+    Handle                acquire();       // blocks if `max_size` states are in use
+    std::optional<Handle> try_acquire();   // returns empty if `max_size` states are in use
+
+    void shrink(size_t keep_idle=0);       // close idle states, keeping at most `keep_idle`
+
+    [[nodiscard]] size_t size() const;     // idle + in use
+    [[nodiscard]] size_t idle() const;
+
+private:
+    Entry create() const;                                   // throws std::runtime_error if the state can't be created
+                                                            //   or initialized
+    Entry create_in_use(std::unique_lock<std::mutex>& lock);
+    void  reset(Entry& entry) const;
+    void  release(Entry entry);
+    Entry take_idle();
+
+    static void close(Entry& entry);
+
+    LuaStatePoolConfig         config_;
+    mutable std::mutex         mutex_;
+    std::condition_variable    available_;
+    std::vector<Entry>         idle_;
+    size_t                     in_use_ = 0;
+    size_t                     creating_ = 0;
+};
+
+#endif //LUAW_POOL_HH_
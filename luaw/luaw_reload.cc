@@ -0,0 +1,379 @@
+#include "luaw_reload.hh"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+using namespace std::string_literals;
+using clock_ = std::chrono::steady_clock;
+
+static std::chrono::microseconds since(clock_::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock_::now() - start);
+}
+
+static timespec modification_time(std::string const& filename)
+{
+    struct stat st {};
+    if (stat(filename.c_str(), &st) != 0)
+        return {};
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+static std::pair<std::string, std::string> split_path(std::string const& filename)   // directory, file name
+{
+    size_t slash = filename.rfind('/');
+    if (slash == std::string::npos)
+        return { ".", filename };
+    return { slash == 0 ? "/" : filename.substr(0, slash), filename.substr(slash + 1) };
+}
+
+//
+// REBINDING
+//
+
+// pushes a table with the functions in table `index`, by key
+static void snapshot_functions(lua_State* L, int index)
+{
+    index = luaw_absindex(L, index);
+    lua_newtable(L);
+    if (lua_type(L, index) != LUA_TTABLE)
+        return;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        if (lua_type(L, -1) == LUA_TFUNCTION) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+}
+
+// for each function in `snapshot` replaced by another one in `table`, sets replacements[old] = new
+static size_t find_replaced(lua_State* L, int snapshot, int table, int replacements)
+{
+    snapshot = luaw_absindex(L, snapshot);
+    table = luaw_absindex(L, table);
+    replacements = luaw_absindex(L, replacements);
+
+    size_t n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, snapshot) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, table);
+        if (lua_type(L, -1) == LUA_TFUNCTION && !lua_rawequal(L, -1, -2)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, replacements);
+            ++n;
+        } else {
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    return n;
+}
+
+// replaces the fields of the old module table by the ones of the new module table (at the top), keeping the
+// identity of the old one
+static void patch_module(lua_State* L, int old_module)
+{
+    old_module = luaw_absindex(L, old_module);
+    int new_module = lua_gettop(L);
+
+    // fields removed from the module (clearing existing fields is allowed during a traversal)
+    lua_pushnil(L);
+    while (lua_next(L, old_module) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, new_module);
+        bool removed = lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (removed) {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, old_module);
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, old_module);
+    }
+    lua_pop(L, 1);
+}
+
+// replaces the values in the registry found in `replacements`
+static size_t rebind_registry(lua_State* L, int replacements)
+{
+    replacements = luaw_absindex(L, replacements);
+    size_t n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX) != 0) {
+        if (lua_type(L, -1) == LUA_TFUNCTION) {
+            lua_rawget(L, replacements);
+            if (!lua_isnil(L, -1)) {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, LUA_REGISTRYINDEX);   // assigning to an existing field is allowed while traversing
+                ++n;
+                continue;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return n;
+}
+
+//
+// RELOADER
+//
+
+LuaReloader::LuaReloader()
+{
+#ifdef __linux__
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);   // on failure, modification times are checked
+#endif
+}
+
+LuaReloader::~LuaReloader()
+{
+    if (inotify_fd_ >= 0)
+        close(inotify_fd_);
+}
+
+void LuaReloader::dofile(lua_State* L, std::string const& filename)
+{
+    File file { L, filename, "" };
+    watch(file);
+    LuaReloadEvent event = reload(file);
+    if (!event.ok) {
+        release_watch(file.wd);
+        throw std::runtime_error(event.error);
+    }
+    files_.push_back(std::move(file));
+}
+
+void LuaReloader::require(lua_State* L, std::string const& module, int nresults)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    lua_pushstring(L, module.c_str());
+    lua_getfield(L, -3, "path");
+    int r = lua_pcall(L, 2, 2, 0);
+    if (r != LUA_OK || lua_isnil(L, -2)) {
+        std::string error = "Module '" + module + "' not found";
+        if (lua_isstring(L, -1))
+            error += ": "s + lua_tostring(L, -1);
+        lua_pop(L, r == LUA_OK ? 3 : 2);
+        throw std::runtime_error(error);
+    }
+    File file { L, lua_tostring(L, -2), module };
+    lua_pop(L, 3);
+
+    watch(file);
+    LuaReloadEvent event = reload(file);
+    if (!event.ok) {
+        release_watch(file.wd);
+        throw std::runtime_error(event.error);
+    }
+    files_.push_back(std::move(file));
+
+    if (nresults > 0) {
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "loaded");
+        lua_getfield(L, -1, module.c_str());
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+    }
+}
+
+void LuaReloader::forget(lua_State* L)
+{
+    std::set<int> wds;
+    for (File const& file : files_)
+        if (file.L == L)
+            wds.insert(file.wd);
+    std::erase_if(files_, [L](File const& file) { return file.L == L; });
+    for (int wd : wds)
+        release_watch(wd);
+}
+
+void LuaReloader::watch(File& file)
+{
+    file.mtime = modification_time(file.filename);
+#ifdef __linux__
+    // the directory is watched, as editors often replace the file instead of writing to it
+    if (inotify_fd_ >= 0)
+        file.wd = inotify_add_watch(inotify_fd_, split_path(file.filename).first.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+}
+
+// a directory is watched once for all its files (inotify returns the same watch): the watch is removed when
+// no file uses it anymore
+void LuaReloader::release_watch(int wd)
+{
+#ifdef __linux__
+    if (wd < 0 || std::any_of(files_.begin(), files_.end(), [wd](File const& file) { return file.wd == wd; }))
+        return;
+    inotify_rm_watch(inotify_fd_, wd);
+#else
+    (void) wd;
+#endif
+}
+
+void LuaReloader::changed_files(std::vector<bool>& changed)
+{
+    bool overflow = false;
+#ifdef __linux__
+    if (inotify_fd_ >= 0) {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t n;
+        while ((n = read(inotify_fd_, buffer, sizeof buffer)) > 0) {
+            for (char* p = buffer; p < buffer + n; ) {
+                auto event = (inotify_event const *) p;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;      // events were lost
+                } else if (event->len > 0) {
+                    for (size_t i = 0; i < files_.size(); ++i)
+                        if (files_[i].wd == event->wd && split_path(files_[i].filename).second == event->name)
+                            changed[i] = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+#endif
+
+    // files not watched by inotify (or all files, if inotify lost events)
+    for (size_t i = 0; i < files_.size(); ++i) {
+        if (files_[i].wd < 0 || overflow) {
+            timespec mtime = modification_time(files_[i].filename);
+            if (mtime.tv_sec != files_[i].mtime.tv_sec || mtime.tv_nsec != files_[i].mtime.tv_nsec)
+                changed[i] = true;
+        }
+    }
+}
+
+std::vector<LuaReloadEvent> LuaReloader::poll()
+{
+    std::vector<bool> changed(files_.size(), false);
+    changed_files(changed);
+
+    std::vector<LuaReloadEvent> events;
+    for (size_t i = 0; i < files_.size(); ++i) {
+        if (changed[i]) {
+            files_[i].mtime = modification_time(files_[i].filename);
+            events.push_back(reload(files_[i]));
+        }
+    }
+    return events;
+}
+
+LuaReloadEvent LuaReloader::reload(File const& file)
+{
+    lua_State* L = file.L;
+    int top = lua_gettop(L);
+    LuaReloadEvent event { .L = L, .filename = file.filename, .module = file.module };
+
+    auto fail = [&](std::string const& prefix) {   // errors are reported like `luaw_do`
+        const char* msg = lua_tostring(L, -1);
+        event.error = prefix + (msg ? msg : "Unknown Lua error");
+        lua_settop(L, top);
+        return event;
+    };
+
+    // compile
+
+    auto start = clock_::now();
+    int r = luaL_loadfile(L, file.filename.c_str());
+    event.compile_time = since(start);
+    if (r != LUA_OK)
+        return fail(r == LUA_ERRSYNTAX ? "Syntax error: " : "");
+
+    // run, keeping the functions that might be replaced
+
+    luaw_push_globals(L);
+    int globals = lua_gettop(L);
+    snapshot_functions(L, globals);
+    int old_globals = lua_gettop(L);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_replace(L, -2);
+    int loaded = lua_gettop(L);
+    if (!file.module.empty())
+        lua_getfield(L, loaded, file.module.c_str());
+    else
+        lua_pushnil(L);
+    int old_module = lua_gettop(L);
+    snapshot_functions(L, old_module);
+    int old_module_functions = lua_gettop(L);
+
+    lua_pushvalue(L, top + 1);   // the chunk
+    int nargs = 0;
+    if (!file.module.empty()) {
+        lua_pushstring(L, file.module.c_str());
+        lua_pushstring(L, file.filename.c_str());
+        nargs = 2;
+    }
+
+    start = clock_::now();
+    r = lua_pcall(L, nargs, 1, 0);
+    event.run_time = since(start);
+    if (r != LUA_OK)
+        return fail("Runtime error: ");
+
+    // rebind
+
+    start = clock_::now();
+    lua_newtable(L);
+    int replacements = lua_gettop(L);
+    int result = replacements - 1;
+
+    event.functions = find_replaced(L, old_globals, globals, replacements);
+
+    if (!file.module.empty()) {
+        if (lua_isnil(L, result)) {             // like `require`: the chunk may have set package.loaded itself
+            lua_getfield(L, loaded, file.module.c_str());
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushboolean(L, 1);
+            }
+            lua_replace(L, result);
+        }
+        if (lua_type(L, old_module) == LUA_TTABLE && lua_type(L, result) == LUA_TTABLE && !lua_rawequal(L, old_module, result)) {
+            event.functions += find_replaced(L, old_module_functions, result, replacements);
+            lua_pushvalue(L, result);
+            patch_module(L, old_module);
+            lua_pushvalue(L, old_module);
+        } else {
+            lua_pushvalue(L, result);
+        }
+        lua_setfield(L, loaded, file.module.c_str());
+    }
+
+    if (event.functions > 0)
+        event.references = rebind_registry(L, replacements);
+    event.rebind_time = since(start);
+
+    lua_settop(L, top);
+    event.ok = true;
+    return event;
+}
@@ -0,0 +1,68 @@
+#ifndef LUAW_RELOAD_HH_
+#define LUAW_RELOAD_HH_
+
+#include "luaw.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+
+struct LuaReloadEvent {
+    lua_State*                L = nullptr;
+    std::string               filename {};
+    std::string               module {};         // empty if loaded with `dofile`
+    bool                      ok = false;        // on error, the previous code is kept (changes to globals made
+    std::string               error {};          //   before the error are not undone)
+    size_t                    functions = 0;     // functions replaced by new versions (in globals and module)
+    size_t                    references = 0;    // registry references rebound to the new versions
+    std::chrono::microseconds compile_time {};
+    std::chrono::microseconds run_time {};
+    std::chrono::microseconds rebind_time {};
+};
+
+// Watches the files loaded through it (with inotify on Linux, checking modification times elsewhere), and
+// reloads the files that changed when `poll` is called. `poll` must be called at a safe point, when none of
+// the states is running code (e.g. between requests).
+//
+// When a file is reloaded, the functions it replaced are also replaced in the registry (so `LuaFunction`
+// handles see the new code), and the fields of a module replace the ones of the table already in
+// `package.loaded` (so code holding the module table sees the new functions).
+class LuaReloader {
+public:
+    LuaReloader();
+    ~LuaReloader();
+
+    LuaReloader(LuaReloader const&) = delete;
+    LuaReloader& operator=(LuaReloader const&) = delete;
+
+    // like `luaw_dofile` and `require`, but throw std::runtime_error on errors
+    void dofile(lua_State* L, std::string const& filename);
+    void require(lua_State* L, std::string const& module, int nresults=0);
+
+    void forget(lua_State* L);   // stop reloading files in `L` (call before closing it)
+
+    std::vector<LuaReloadEvent> poll();   // reload files changed since the last call
+
+    [[nodiscard]] size_t watched() const { return files_.size(); }
+
+private:
+    struct File {
+        lua_State*  L;
+        std::string filename;
+        std::string module;
+        int         wd = -1;        // inotify watch (of the directory)
+        timespec    mtime {};
+    };
+
+    void           watch(File& file);
+    void           release_watch(int wd);
+    void           changed_files(std::vector<bool>& changed);
+    LuaReloadEvent reload(File const& file);
+
+    std::vector<File> files_;
+    int               inotify_fd_ = -1;
+};
+
+#endif //LUAW_RELOAD_HH_
@@ -0,0 +1,3 @@
+struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; } test[] = {
+  { 0, 0, nullptr, {} }
+};
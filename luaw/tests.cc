@@ -1,12 +1,26 @@
 #include "luaw.hh"
+#include "luaw_coroutine.hh"
+#include "luaw_executor.hh"
+#include "luaw_pool.hh"
+#include "luaw_reload.hh"
 
 #include <cassert>
 #include <cstring>
 #include <cstdio>
-
+#include <unistd.h>
+#include <zlib.h>
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <span>
 #include <string>
 #include <tuple>
 #include <map>
+#include <optional>
 #include <set>
 #include <variant>
 #include <vector>
@@ -34,6 +48,20 @@ struct Wrappeable {
     static constexpr const char* mt_identifier = "WRP";
 };
 
+struct Event {
+    std::string                name;
+    int                        priority = 0;
+    std::optional<std::string> tag;
+    std::vector<double>        values;
+
+    static constexpr auto lua_fields = std::make_tuple(
+        LUAW_FIELD(Event, name),
+        LUAW_FIELD(Event, priority),
+        LUAW_FIELD(Event, tag),
+        luaw_field("samples", &Event::values)
+    );
+};
+
 int main()
 {
     lua_State* L = luaw_newstate();
@@ -102,6 +130,20 @@ int main()
     luaw_push(L, "hello"s); assert(luaw_pop<std::string>(L) == "hello");
     luaw_push(L, "hello"); assert(std::string(luaw_pop<const char*>(L)) == "hello");
 
+    std::string binary("a\0b\0c", 5);
+    luaw_push(L, binary); assert(luaw_len(L, -1) == 5); assert(luaw_pop<std::string>(L) == binary);
+
+    luaw_push(L, std::string_view(binary));
+    assert(luaw_is<std::string_view>(L, -1));
+    assert(luaw_to<std::string_view>(L, -1) == binary);
+    lua_pop(L, 1);
+
+    const std::byte bytes[] = { std::byte { 0 }, std::byte { 0xff }, std::byte { 42 } };
+    luaw_push(L, std::span<const std::byte>(bytes));
+    auto bspan = luaw_to<std::span<const std::byte>>(L, -1);
+    assert(bspan.size() == 3 && bspan[1] == std::byte { 0xff } && bspan[2] == std::byte { 42 });
+    lua_pop(L, 1);
+
     int* x = (int *) malloc(sizeof(int));
     *x = 40;
     luaw_push<int *>(L, x);
@@ -112,6 +154,28 @@ int main()
     luaw_push(L, v);
     assert(luaw_pop<std::vector<int>>(L) == v);
 
+    std::vector<double> vd { 1.5, 2.5, -3 };
+    luaw_push(L, vd);
+    assert(luaw_len(L, -1) == 3);
+    assert(luaw_pop<std::vector<double>>(L) == vd);
+
+    std::array<int, 3> arr { 4, 5, 6 };
+    luaw_push(L, arr);
+    assert(luaw_is<decltype(arr)>(L, -1));
+    assert((luaw_is<std::array<int, 2>>(L, -1) == false));
+    assert(luaw_pop<decltype(arr)>(L) == arr);
+
+    luaw_push(L, std::span<const double>(vd));
+    assert(luaw_pop<std::vector<double>>(L) == vd);
+
+    std::set<std::string> ss { "a", "b" };
+    luaw_push(L, ss);
+    assert(luaw_len(L, -1) == 2);
+    assert(luaw_pop<std::set<std::string>>(L) == ss);
+
+    luaw_do(L, "return { 1, 2.0, 3 }", 1);
+    assert((luaw_pop<std::vector<int>>(L) == std::vector<int> { 1, 2, 3 }));
+
     std::optional<int> o = 42;
     luaw_push(L, o); assert(luaw_pop<std::optional<int>>(L) == 42);
 
@@ -130,6 +194,21 @@ int main()
     luaw_is<std::map<std::string, int>>(L, -1);
     assert(luaw_pop<decltype(mp)>(L) == mp);
 
+    luaw_do(L, "return { 1, 2, 'x' }", 1);
+    std::string err;
+    assert(!luaw_try_to<std::vector<int>>(L, -1, &err));
+    printf("%s\n", err.c_str());
+    assert(err.starts_with("[3]"));
+    assert(luaw_try_to<std::vector<std::optional<double>>>(L, -1) == std::nullopt);
+    lua_pop(L, 1);
+
+    luaw_do(L, "return { a = { 1, 2 }, b = { 3 } }", 1);
+    auto nested = luaw_try_to<std::map<std::string, std::vector<int>>>(L, -1);
+    assert(nested && nested->at("a") == std::vector<int>({ 1, 2 }) && nested->at("b").size() == 1);
+    assert((!luaw_try_to<std::map<std::string, int>>(L, -1, &err)));
+    printf("%s\n", err.c_str());
+    lua_pop(L, 1);
+
     /*
     std::variant<int, double> vv { 42 };
     luaw_push(L, vv);
@@ -160,6 +239,10 @@ int main()
         printf("%s: %s   ", key.c_str(), luaw_dump(L, -1).c_str());
     });
     printf("\n");
+    luaw_spairs(L, -1, [](lua_State*, std::string_view key) {
+        printf("%.*s ", (int) key.size(), key.data());
+    });
+    printf("\n");
     luaw_pairs(L, -1, [](lua_State* L) {
         printf("%s: %s   ", luaw_dump(L, -2).c_str(), luaw_dump(L, -1).c_str());
     });
@@ -188,6 +271,27 @@ int main()
     luaw_setfield(L, -1, "a.b.e", "hello");
     assert(luaw_getfield<std::string>(L, -1, "a.b.e") == "hello");
 
+    LuaFieldPath path("a.b.c");
+    assert(luaw_hasfield(L, -1, path));
+    assert(luaw_getfield<int>(L, -1, path) == 84);
+    luaw_setfield(L, -1, path, 85);
+    assert(luaw_getfield<int>(L, -1, "a.b.c") == 85);
+    assert(!luaw_hasfield(L, -1, LuaFieldPath("a.x.c")));
+    for (const char* bad : { "", "a..b", ".a", "a." }) {
+        try {
+            LuaFieldPath bad_path(bad);
+            assert(false);
+        } catch (std::runtime_error&) {}
+    }
+
+    static constexpr LuaStaticFieldPath spath("a.b.d");
+    static_assert(spath.size() == 3);
+    assert(luaw_getfield<int>(L, -1, spath) == 65);
+    luaw_push(L, 66);
+    luaw_setfield(L, -2, spath);
+    luaw_getfield(L, -1, LuaStaticFieldPath("a.b.d"));
+    assert(luaw_pop<int>(L) == 66);
+
     lua_pop(L, 1);
 
     printf("---------------------\n");
@@ -200,6 +304,18 @@ int main()
     luaw_do(L, "function hello(str) print('Hello '..str..'!') end");
     luaw_call_global(L, "hello", "world");
 
+    LuaFunction<int(int)> dbl_fn(L, "dbl");
+    assert(dbl_fn(24) == 48);
+    assert(dbl_fn(5) == 10);
+
+    LuaFunction<void(std::string)> hello_fn(L, "hello");
+    hello_fn("handle");
+
+    luaw_do(L, "return { ops = { triple = function(x) return x * 3 end } }", 1);
+    LuaFunction<int(int)> triple_fn(L, -1, LuaFieldPath("ops.triple"));
+    lua_pop(L, 1);
+    assert(triple_fn(4) == 12);
+
     luaw_ensure(L);
 
     // table types
@@ -246,6 +362,24 @@ int main()
 
     luaw_do(L, "print(pt1)");
 
+    // described struct
+
+    luaw_push(L, Event { "ev", 3, {}, { 1, 2 } });
+    assert(luaw_is<Event>(L, -1));
+    assert(luaw_getfield<int>(L, -1, "priority") == 3);
+    assert(luaw_getfield<std::vector<double>>(L, -1, "samples").size() == 2);
+    Event ev = luaw_pop<Event>(L);
+    assert(ev.name == "ev" && ev.priority == 3 && !ev.tag && ev.values.size() == 2);
+
+    ev = luaw_do<Event>(L, "return { name = 'x', priority = 1, tag = 't', samples = { 5 } }");
+    assert(ev.tag == "t" && ev.values == std::vector<double> { 5 });
+
+    luaw_do(L, "return { name = 'x' }", 1);
+    assert(!luaw_is<Event>(L, -1));
+    lua_pop(L, 1);
+
+    luaw_ensure(L);
+
     // userdata
     struct Hello {
         Hello(std::string s) { printf("HELLO %s!\n", s.c_str()); }
@@ -291,6 +425,544 @@ int main()
     luaw_do(L, "function test(obj) print(obj:test()) end");
     luaw_call_global(L, "test", wptr.get());
 
+    // pool allocator
+
+    {
+        lua_State* P = luaw_newstate({ .pool_allocator = true });
+        assert(!luaw_alloc_stats(L));
+        auto stats = luaw_alloc_stats(P);
+        if (stats) {   // LuaJIT might not support custom allocators
+            luaw_do(P, "local t = {} for i = 1, 1000 do t[i] = { tostring(i) } end");
+            lua_gc(P, LUA_GCCOLLECT, 0);
+            LuaAllocStats after = *luaw_alloc_stats(P);
+            assert(after.allocations > stats->allocations && after.frees > stats->frees);
+            assert(after.peak_bytes > after.bytes_in_use && after.chunks > 0);
+        }
+        assert(luaw_do<int>(P, "return 6 * 7") == 42);
+        luaw_close(P);
+    }
+
+    // memory limit & accounting
+
+    {
+        lua_State* P = luaw_newstate({ .memory_limit = 4 * 1024 * 1024 });
+        if (P) {   // LuaJIT might not support custom allocators
+            LuaMemoryStats m = luaw_memory(P);
+            assert(m.limit == 4 * 1024 * 1024);
+            assert(m.live > 0 && m.live <= m.limit && m.peak >= m.live);
+            assert(!luaw_do<bool>(P, "return pcall(function() local t = {} for i = 1, 1e7 do t[i] = i end end)"));
+            assert(luaw_alloc_stats(P)->limit_failures > 0);
+            assert(luaw_memory(P).peak <= m.limit);
+            assert(luaw_do<int>(P, "return 6 * 7") == 42);   // still usable
+            luaw_close(P);
+        }
+
+        size_t cycles = luaw_memory(L).gc_cycles;
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        assert(luaw_memory(L).gc_cycles > cycles && luaw_memory(L).live > 0);
+
+        for (bool pooled : { false, true }) {   // live bytes counted by Lua, or by the luaw allocator
+            lua_State* D = luaw_newstate({ .pool_allocator = pooled });
+            lua_gc(D, LUA_GCCOLLECT, 0);
+            lua_gc(D, LUA_GCCOLLECT, 0);
+            size_t debt = luaw_memory(D).gc_debt;
+            lua_gc(D, LUA_GCSTOP, 0);
+            luaw_do(D, "debt_keep = {} for i = 1, 10000 do debt_keep[i] = { i } end");
+            assert(luaw_memory(D).gc_debt > debt + 100000);
+            lua_gc(D, LUA_GCRESTART, 0);
+            luaw_close(D);
+        }
+    }
+
+    // garbage collection
+
+    {
+        lua_State* G = luaw_newstate();
+#if LUAW == JIT
+        assert(!luaw_gc_mode(G, LuaGcMode::Generational));
+#else
+        assert(luaw_gc_mode(G, LuaGcMode::Generational));
+        assert(luaw_gc_stats(G).mode == LuaGcMode::Generational);
+        assert(luaw_gc_mode(G, LuaGcMode::Incremental));
+#endif
+        luaw_do(G, "local t = {} for i = 1, 10000 do t[i] = { i } end");
+        lua_gc(G, LUA_GCSTOP, 0);
+        while (!luaw_gc_step(G, std::chrono::microseconds(100))) {}
+        luaw_gc_collect(G);
+        LuaGcStats st = luaw_gc_stats(G);
+        assert(st.pauses >= 2 && st.cycles_completed >= 2);
+        assert(st.max_pause >= st.last_pause && st.total_pause >= st.max_pause);
+        luaw_close(G);
+    }
+
+    // compiled chunks
+
+    {
+        luaw_do(L, "chunk_counter = 0");   // declared (strict mode)
+        LuaChunk chunk(L, "chunk_counter = (chunk_counter or 0) + 1 return chunk_counter", "counter");
+        assert(chunk.run<int>() == 1);
+        assert(chunk.run<int>() == 2);
+
+        lua_State* C = luaw_newstate({ .chunk_cache = 2 });
+        for (int i = 0; i < 3; ++i)
+            assert(luaw_do<int>(C, "return 1 + 1") == 2);
+        assert(luaw_do<int>(C, "return 1 + 2") == 3);
+        assert(luaw_do<int>(C, "return 1 + 3") == 4);         // evicts "return 1 + 1"
+        assert(luaw_do<int>(C, "return 1 + 1", "other") == 2);   // different name, different entry
+        LuaChunkCacheStats st = luaw_chunk_cache_stats(C);
+        assert(st.hits == 2 && st.misses == 4 && st.entries == 2);
+        luaw_set_chunk_cache(C, 0);
+        assert(luaw_chunk_cache_stats(C).entries == 0);
+        luaw_close(C);
+    }
+
+    // file loading & bytecode cache
+
+    {
+        namespace fs = std::filesystem;
+        fs::path dir = fs::temp_directory_path() / ("luaw_test_" + std::to_string(getpid()));
+        fs::create_directories(dir / "cache");
+        std::ofstream(dir / "script.lua") << "file_counter = (file_counter or 0) + 1\nreturn file_counter * 10";
+
+        std::string cache_dir = (dir / "cache").string();
+        lua_State* F = luaw_newstate({ .bytecode_cache_dir = cache_dir });
+        luaw_do(F, "file_counter = 0");   // declared (strict mode)
+        luaw_dofile(F, (dir / "script.lua").string(), 1, "script.lua");
+        assert(luaw_pop<int>(F) == 10);
+        assert(std::distance(fs::directory_iterator(dir / "cache"), fs::directory_iterator()) == 1);
+        luaw_dofile(F, (dir / "script.lua").string(), 1, "script.lua");   // loaded from the cache
+        assert(luaw_pop<int>(F) == 20);
+
+        std::ofstream(dir / "script.lua") << "return 42";                 // changed: compiled again
+        luaw_dofile(F, (dir / "script.lua").string(), 1, "script.lua");
+        assert(luaw_pop<int>(F) == 42);
+        assert(std::distance(fs::directory_iterator(dir / "cache"), fs::directory_iterator()) == 2);
+        luaw_close(F);
+
+        fs::remove_all(dir);
+    }
+
+    // parallel loading
+
+    {
+        namespace fs = std::filesystem;
+        fs::path file = fs::temp_directory_path() / ("luaw_parallel_" + std::to_string(getpid()) + ".lua");
+        std::ofstream(file) << "par_order[#par_order + 1] = 'file'";
+
+        lua_State* P = luaw_newstate();
+        std::vector<LuaSource> sources { { .code = "par_order = {}" } };
+        for (int i = 0; i < 20; ++i)
+            sources.push_back({ .code = "par_order[#par_order + 1] = " + std::to_string(i), .name = "src" + std::to_string(i) });
+        sources.push_back({ .filename = file.string() });
+        luaw_do_parallel(P, sources, 4);
+        assert(luaw_do<int>(P, "return #par_order") == 21);
+        assert(luaw_do<int>(P, "return par_order[20]") == 19);                 // run in order
+        assert(luaw_do<std::string>(P, "return par_order[21]") == "file");
+
+        // errors are raised like luaw_do, and the following sources are not run
+        lua_pushcfunction(P, [](lua_State* L) {
+            luaw_do_parallel(L, { { .code = "par_ran = 1" }, { .code = "par_ran = = 2", .name = "bad" }, { .code = "par_ran = 3" } });
+            return 0;
+        });
+        assert(lua_pcall(P, 0, 0, 0) == LUA_ERRRUN);
+        assert(std::string(lua_tostring(P, -1)).starts_with("Syntax error: "));
+        lua_pop(P, 1);
+        assert(luaw_do<int>(P, "return par_ran") == 1);
+
+        lua_pushcfunction(P, [](lua_State* L) {
+            luaw_do_parallel(L, { { .code = "error('oops')" } });
+            return 0;
+        });
+        assert(lua_pcall(P, 0, 0, 0) == LUA_ERRRUN);
+        assert(std::string(lua_tostring(P, -1)).starts_with("Runtime error: "));
+        lua_pop(P, 1);
+
+        luaw_close(P);
+        fs::remove(file);
+    }
+
+    // hot reload
+
+    {
+        namespace fs = std::filesystem;
+        fs::path dir = fs::temp_directory_path() / ("luaw_reload_" + std::to_string(getpid()));
+        fs::create_directories(dir);
+        std::ofstream(dir / "hot.lua") << "function hot_value() return 1 end";
+        std::ofstream(dir / "hotmod.lua") << "local M = {} function M.get() return 'a' end function M.gone() end return M";
+
+        lua_State* R = luaw_newstate();
+        LuaReloader reloader;
+        reloader.dofile(R, (dir / "hot.lua").string());
+        luaw_do(R, "package.path = '" + dir.string() + "/?.lua;' .. package.path");
+        reloader.require(R, "hotmod");
+        luaw_do(R, "held = require('hotmod')");
+        assert(reloader.watched() == 2);
+
+        {
+            LuaFunction<int()> hot_value(R, "hot_value");
+            assert(hot_value() == 1);
+            assert(reloader.poll().empty());
+
+            std::ofstream(dir / "hot.lua") << "function hot_value() return 2 end";
+            std::ofstream(dir / "hotmod.lua") << "local M = {} function M.get() return 'b' end return M";
+            auto events = reloader.poll();
+            assert(events.size() == 2 && events[0].ok && events[1].ok);
+            for (auto const& e : events)
+                printf("reloaded %s in %lld us (compile %lld, run %lld, rebind %lld), %zu references\n", e.filename.c_str(),
+                       (long long) (e.compile_time + e.run_time + e.rebind_time).count(), (long long) e.compile_time.count(),
+                       (long long) e.run_time.count(), (long long) e.rebind_time.count(), e.references);
+            assert(hot_value() == 2);                                                  // handle rebound
+            assert(luaw_do<std::string>(R, "return held.get()") == "b");              // module patched in place
+            assert(luaw_do<bool>(R, "return held == require('hotmod')"));
+            assert(luaw_do<bool>(R, "return held.gone == nil"));                       // removed from the module
+
+            std::ofstream(dir / "hot.lua") << "function hot_value( return 3 end";
+            events = reloader.poll();
+            assert(events.size() == 1 && !events[0].ok && events[0].error.starts_with("Syntax error: "));
+            assert(hot_value() == 2);                                                  // previous code kept
+        }
+
+        reloader.forget(R);
+        luaw_close(R);
+        fs::remove_all(dir);
+    }
+
+    // archives
+
+    {
+        namespace fs = std::filesystem;
+        fs::path dir = fs::temp_directory_path() / ("luaw_archive_" + std::to_string(getpid()));
+        fs::create_directories(dir);
+
+        // entries are sorted by name: (name, source, compressed)
+        auto write_archive = [](fs::path const& path, std::vector<std::tuple<std::string, std::string, bool>> const& files) {
+            std::vector<LuaArchiveEntry> entries(files.size());
+            std::vector<std::string> data;
+            uint64_t offset = sizeof(LuaArchiveHeader) + files.size() * sizeof(LuaArchiveEntry);
+            for (size_t i = 0; i < files.size(); ++i) {
+                auto const& [name, source, compressed] = files[i];
+                entries[i].name_offset = offset;
+                entries[i].name_len = (uint32_t) name.size();
+                offset += name.size();
+                std::string d = source;
+                if (compressed) {
+                    d.resize(compressBound(source.size()));
+                    uLongf len = d.size();
+                    compress2((Bytef *) d.data(), &len, (const Bytef *) source.data(), source.size(), Z_BEST_COMPRESSION);
+                    d.resize(len);
+                    entries[i].uncompressed = source.size();
+                }
+                entries[i].size = d.size();
+                entries[i].crc32 = (uint32_t) crc32_z(0, (const Bytef *) d.data(), d.size());
+                data.push_back(std::move(d));
+            }
+            for (size_t i = 0; i < files.size(); ++i) {
+                entries[i].data_offset = offset;
+                offset += data[i].size();
+            }
+            LuaArchiveHeader header { .count = (uint32_t) files.size() };
+            memcpy(header.magic, luaw_archive_magic, sizeof header.magic);
+            std::ofstream f(path, std::ios::binary);
+            f.write((const char *) &header, sizeof header);
+            f.write((const char *) entries.data(), (std::streamsize) (entries.size() * sizeof(LuaArchiveEntry)));
+            for (auto const& [name, source, compressed] : files)
+                f << name;
+            for (auto const& d : data)
+                f << d;
+        };
+
+        write_archive(dir / "v1.arc", { { "a.lua", "return 'a1'", false }, { "b.lua", "return 'b' .. 1", true } });
+        write_archive(dir / "v2.arc", { { "a.lua", "return 'a2'", true } });
+
+        lua_State* A = luaw_newstate();
+        LuaArchive archive((dir / "v1.arc").string());
+        assert(archive.contains("a.lua") && archive.contains("b.lua") && !archive.contains("c.lua"));
+        assert((archive.names() == std::vector<std::string> { "a.lua", "b.lua" }));
+        archive.run(A, "a.lua", 1);
+        assert(luaw_pop<std::string>(A) == "a1");
+        archive.run(A, "b.lua", 1);
+        assert(luaw_pop<std::string>(A) == "b1");
+
+        // errors are raised in Lua
+        lua_pushlightuserdata(A, &archive);
+        lua_pushcclosure(A, [](lua_State* L) {
+            ((LuaArchive *) lua_touserdata(L, lua_upvalueindex(1)))->load(L, "c.lua");
+            return 1;
+        }, 1);
+        assert(lua_pcall(A, 0, 1, 0) == LUA_ERRRUN);
+        assert(std::string(lua_tostring(A, -1)).find("Archive entry 'c.lua' not found") != std::string::npos);
+        lua_pop(A, 1);
+
+        archive.reload((dir / "v2.arc").string());     // swap
+        archive.run(A, "a.lua", 1);
+        assert(luaw_pop<std::string>(A) == "a2");
+        assert(!archive.contains("b.lua"));
+
+        std::ofstream(dir / "bad.arc") << "not an archive";
+        try {
+            archive.reload((dir / "bad.arc").string());
+            assert(false);
+        } catch (std::runtime_error&) {}
+        assert(archive.path() == (dir / "v2.arc").string());   // kept the current archive
+
+        fs::rename(dir / "v1.arc", dir / "v2.arc");    // replaced on disk
+        archive.reload();
+        archive.run(A, "b.lua", 1);
+        assert(luaw_pop<std::string>(A) == "b1");
+
+        // archives written by luazh (see the check targets)
+#if LUAW == JIT
+        for (const char* path : { "luaw/test-jit.arc", "luaw/test-jit-u.arc" }) {
+#else
+        for (const char* path : { "luaw/test-54.arc", "luaw/test-54-u.arc" }) {
+#endif
+            LuaArchive luazh_archive(path);
+            assert((luazh_archive.names() == std::vector<std::string> { "luazh/test.lua" }));
+            luazh_archive.run(A, "luazh/test.lua");
+            assert(luaw_do<bool>(A, "return type(print_hello) == 'function'"));
+        }
+
+        luaw_close(A);
+        fs::remove_all(dir);
+    }
+
+    // strict mode
+
+    {
+        lua_State* S = luaw_newstate();
+        assert(!luaw_do<bool>(S, "return pcall(function() return undeclared_var end)"));
+        assert(!luaw_do<bool>(S, "return pcall(function() undeclared_var = 1 end)"));
+        luaw_do(S, "declared_var = 1");
+        assert(luaw_do<bool>(S, "return pcall(function() declared_var = declared_var + 1 end)"));
+
+        std::vector<std::string> errors;
+        assert(!luaw_check_globals(S, "local a = 1\nfunction f() return a + nope end", &errors));
+        assert(errors.size() == 1 && errors[0] == "line 2: variable 'nope' is not declared");
+        assert(luaw_check_globals(S, "gv = 1\nfunction gf(x) local t = { k = x } gv = t.k return gv + declared_var end"));
+        luaw_do(S, "function late() late_var = 1 end");
+        assert(luaw_check_globals(S, "late_var = 2"));     // the check doesn't declare anything...
+        assert(!luaw_do<bool>(S, "return pcall(late)"));
+        luaw_do(S, "late_var = 2");                        // ...running the chunk does
+        luaw_call_global(S, "late");
+
+        luaw_do_checked(S, "trusted_var = nil\nfunction trusted_f() return trusted_var end");   // declared...
+        assert(luaw_do<bool>(S, "return trusted_f() == nil and getmetatable(_G) ~= nil"));     // ...and strict again
+        assert(!luaw_do<bool>(S, "return pcall(function() return undeclared_var end)"));
+        for (const char* code : { "return nope", "error('oops')" }) {   // check and runtime errors
+            lua_pushlightuserdata(S, (void *) code);
+            lua_pushcclosure(S, [](lua_State* L) {
+                luaw_do_checked(L, (const char *) lua_touserdata(L, lua_upvalueindex(1)));
+                return 0;
+            }, 1);
+            assert(lua_pcall(S, 0, 0, 0) == LUA_ERRRUN);
+            lua_pop(S, 1);
+        }
+        assert(luaw_do<bool>(S, "return getmetatable(_G) ~= nil"));
+        luaw_close(S);
+
+        lua_State* N = luaw_newstate({ .strict = false });
+        assert(luaw_do<bool>(N, "return undeclared_var == nil"));
+        luaw_close(N);
+    }
+
+    // execution budget
+
+    {
+        lua_State* B = luaw_newstate();
+        {
+            LuaBudgetGuard guard(B, { .instructions = 100000 });
+            luaL_loadstring(B, "while true do end");
+            assert(lua_pcall(B, 0, 0, 0) == LUA_ERRRUN && guard.exceeded());
+            printf("%s\n", lua_tostring(B, -1));
+            lua_pop(B, 1);
+
+            luaL_loadstring(B, "pcall(function() while true do end end) return 42");   // can't be caught
+            assert(lua_pcall(B, 0, 1, 0) == LUA_ERRRUN);
+            lua_pop(B, 1);
+        }
+        {
+            LuaBudgetGuard guard(B, { .time = std::chrono::milliseconds(10) });
+            luaL_loadstring(B, "local i = 0 while true do i = i + 1 end");
+            assert(lua_pcall(B, 0, 0, 0) == LUA_ERRRUN && guard.exceeded());
+            lua_pop(B, 1);
+        }
+        {
+            LuaBudgetGuard guard(B, { .instructions = 1000000 });
+            assert(luaw_do<int>(B, "local s = 0 for i = 1, 100 do s = s + i end return s") == 5050 && !guard.exceeded());
+        }
+        assert(!luaw_budget_exceeded(B) && luaw_do<int>(B, "return 42") == 42);
+        luaw_close(B);
+    }
+
+    // profiler
+
+    {
+        lua_State* P = luaw_newstate();
+        luaw_do(P, R"(
+            function prof_inner(n) local s = 0 for i = 1, n do s = s + i end return s end
+            function prof_outer() local s = 0 for i = 1, 100 do s = s + prof_inner(1000) end return s end
+        )", 0, "prof.lua");
+        {
+            LuaProfiler profiler(P, { .instructions = 1000 });
+            LuaBudgetGuard guard(P, { .instructions = 100000000 });   // shares the hook with the profiler
+            luaw_call_global(P, "prof_outer");
+            assert(profiler.samples() > 0);
+            std::string folded = profiler.folded();
+            printf("%s", folded.c_str());
+            assert(folded.find("@prof.lua:3;prof_inner@prof.lua:2 ") != std::string::npos);
+        }
+        assert(lua_gethook(P) == nullptr);
+        luaw_close(P);
+    }
+
+    // state pool
+
+    {
+        LuaStatePool pool({ .initial_size = 1, .max_size = 2, .init_script = "function pool_fn() return 42 end" });
+        {
+            auto h = pool.acquire();
+            assert(luaw_call_global<int>(h, "pool_fn") == 42);
+            luaw_setglobal(h, "pool_tmp", 1);
+            luaw_do(h, "pool_fn = nil");
+            luaw_do(h, "pool_declared = nil");   // declared (strict mode), but not set
+        }
+        assert(pool.idle() == 1);
+        {
+            auto h1 = pool.acquire();
+            lua_getglobal(h1, "pool_tmp");
+            assert(lua_isnil(h1, -1));
+            assert(luaw_call_global<int>(h1, "pool_fn") == 42);
+            assert(!luaw_do<bool>(h1, "return pcall(function() return pool_declared end)"));   // not declared anymore
+
+            auto h2 = pool.acquire();
+            assert(h1.get() != h2.get());
+            assert(pool.size() == 2 && !pool.try_acquire());
+        }
+        pool.shrink(1);
+        assert(pool.size() == 1);
+    }
+
+    {
+        LuaStatePool pool({ .state = { .memory_limit = 1 } });
+        try {
+            pool.acquire();
+            assert(false);
+        } catch (std::runtime_error&) {}
+        assert(pool.size() == 0);
+    }
+
+    try {
+        LuaStatePool pool({ .initial_size = 2, .init_script = "error('pool init failed')" });
+        assert(false);
+    } catch (std::runtime_error& e) {
+        assert(std::string(e.what()).find("pool init failed") != std::string::npos);
+    }
+
+    // executor
+
+    {
+        LuaExecutor executor({ .threads = 4, .init_script = "function exec_sq(x) return x * x end" });
+
+        std::vector<std::future<int>> futures;
+        for (int i = 0; i < 100; ++i)
+            futures.push_back(executor.call<int>("exec_sq", i));
+        for (int i = 0; i < 100; ++i)
+            assert(futures[i].get() == i * i);
+
+        auto keyed1 = executor.submit(7, [](lua_State* L) { luaw_setglobal(L, "exec_key", 42); });
+        keyed1.get();
+        auto keyed2 = executor.submit(7, [](lua_State* L) { return luaw_getglobal<int>(L, "exec_key"); });
+        assert(keyed2.get() == 42);
+
+        std::vector<std::function<int(lua_State*)>> batch;
+        for (int i = 0; i < 10; ++i)
+            batch.push_back([i](lua_State* L) { return luaw_call_global<int>(L, "exec_sq", i); });
+        auto batch_futures = executor.submit_batch(batch);
+        assert(batch_futures[9].get() == 81);
+
+        executor.submit(3, [](lua_State* L) { luaw_do(L, "function exec_len(s) return #s end"); }).get();
+        std::future<int> len;
+        {
+            std::string buffer = "hello";
+            len = executor.call_keyed<int>(3, "exec_len", buffer.c_str());
+            buffer.assign(100, 'x');   // the job has its own copy
+        }
+        assert(len.get() == 5);
+
+        auto failed = executor.submit([](lua_State* L) { luaw_do(L, "error('oops')"); });
+        try {
+            failed.get();
+            assert(false);
+        } catch (std::runtime_error& e) {
+            printf("%s\n", e.what());
+        }
+    }
+
+    {
+        LuaExecutor executor({ .threads = 2, .init_script = "error('executor init failed')" });
+        try {
+            executor.submit([](lua_State*) {}).get();
+            assert(false);
+        } catch (std::runtime_error& e) {
+            assert(std::string(e.what()).find("executor init failed") != std::string::npos);
+        }
+    }
+
+    {
+        LuaExecutor executor({ .threads = 1, .state = { .memory_limit = 1 } });
+        auto failed = executor.submit([](lua_State*) {});
+        try {
+            failed.get();
+            assert(false);
+        } catch (std::runtime_error&) {}
+    }
+
+    // coroutines
+
+    {
+        luaw_do(L, R"(
+            function co_script(x)
+                local a = coroutine.yield(x + 1)
+                local b = coroutine.yield(a * 2)
+                return a + b
+            end
+        )");
+
+        LuaEventLoop loop;
+        std::vector<int> results;
+
+        auto run_script = [](LuaEventLoop& loop, lua_State* L, int x, std::vector<int>& results) -> LuaTask<> {
+            LuaCoroutine co(loop, L, "co_script");
+            int a = co_await co.resume<int>(x);             // yields x + 1
+            co_await loop.sleep_for(std::chrono::milliseconds(1));
+            int b = co_await co.resume<int>(a);             // yields a * 2
+            int r = co_await co.resume<int>(b);             // returns a + b
+            assert(co.done());
+            results.push_back(r);
+        };
+        for (int i = 0; i < 100; ++i)
+            loop.spawn(run_script(loop, L, i, results));
+        assert(loop.tasks() == 100);
+        loop.run();
+        assert(results.size() == 100 && loop.tasks() == 0);
+        assert(results[0] == 3);   // x=0: a=1, b=2
+
+        auto failing = [](LuaEventLoop& loop, lua_State* L) -> LuaTask<> {
+            luaw_do(L, "return function() error('co_fail') end", 1);
+            LuaCoroutine co(loop, L);
+            co_await co.resume();
+        };
+        loop.spawn(failing(loop, L));
+        try {
+            loop.run();
+            assert(false);
+        } catch (std::runtime_error& e) {
+            printf("%s\n", e.what());
+        }
+        luaw_ensure(L);
+    }
+
     // odds & ends
 
     printf("---------------------\n");
@@ -300,6 +972,51 @@ int main()
 
     luaw_do_z(L, test);
 
+    {   // chunk larger than the decompression buffer
+        std::string big = "big_chunk = {}\n";
+        for (int i = 0; i < 5000; ++i)
+            big += "big_chunk[#big_chunk + 1] = " + std::to_string(i) + "\n";
+        std::vector<unsigned char> compressed(compressBound(big.size()));
+        uLongf compressed_len = compressed.size();
+        compress2(compressed.data(), &compressed_len, (const Bytef *) big.data(), big.size(), Z_BEST_COMPRESSION);
+
+        LuaCompressedBytecode big_z[] = {
+            { compressed_len, big.size(), "big.lua", compressed.data() },
+            { 0, 0, nullptr, {} },
+        };
+        luaw_do_z(L, big_z);
+        assert(luaw_do<int>(L, "return #big_chunk") == 5000);
+    }
+
+    {   // embedded modules loaded by require
+        auto compress_source = [](std::string const& src) {
+            std::vector<unsigned char> compressed(compressBound(src.size()));
+            uLongf compressed_len = compressed.size();
+            compress2(compressed.data(), &compressed_len, (const Bytef *) src.data(), src.size(), Z_BEST_COMPRESSION);
+            compressed.resize(compressed_len);
+            return compressed;
+        };
+        std::string mod_a = "embedded_loads = (embedded_loads or 0) + 1; return { name = ... }";
+        std::string mod_b = "return { value = require('emb.a').name .. '!' }";
+        auto a_z = compress_source(mod_a), b_z = compress_source(mod_b);
+
+        LuaCompressedBytecode modules_z[] = {
+            { b_z.size(), mod_b.size(), "emb/b/init.lua", b_z.data() },
+            { a_z.size(), mod_a.size(), "./emb/a.lua", a_z.data() },
+            { 0, 0, nullptr, {} },
+        };
+        lua_State* E = luaw_newstate();   // closed before the arrays go out of scope
+        luaw_do(E, "embedded_loads = 0");   // declared (strict mode)
+        luaw_register_z(E, modules_z);
+        assert(luaw_do<int>(E, "return embedded_loads") == 0);           // nothing loaded yet
+        assert(luaw_do<std::string>(E, "return require('emb.b').value") == "emb.a!");
+        assert(luaw_do<std::string>(E, "return require('emb.b.init').value") == "emb.a!");
+        luaw_do(E, "require('emb.a')");
+        assert(luaw_do<int>(E, "return embedded_loads") == 1);           // loaded once
+        assert(luaw_do<bool>(E, "return not pcall(require, 'emb.missing')"));
+        luaw_close(E);
+    }
+
     luaw_do(L, "return { a={ b={ c={ 48, 13 }, d=12 } }, j=4 }", 1);
     printf("%s\n", luaw_dump(L, -1, false).c_str());
     printf("%s\n", luaw_dump(L, -1, true, 10).c_str());
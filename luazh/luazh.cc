@@ -1,88 +1,372 @@
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
-#include <sstream>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <zlib.h>
 
+#include <unistd.h>
+
 #include "../luaw/luaw.hh"
 
+#if LUAW == JIT
+static const char* bytecode_version = LUAJIT_VERSION;
+#else
+static const char* bytecode_version = LUA_RELEASE;
+#endif
+
 void help(const char* program)
 {
-    printf("%s HEADER_NAME [-s] LUA_FILES...\n", program);
-    printf("Generate Lua bytecode, compress it and generate C header.\n");
+    printf("%s HEADER_NAME [-s] [-j THREADS] [-c CACHE_DIR] [-b BLOB_FILE] LUA_FILES...\n", program);
+    printf("%s -a ARCHIVE [-u] [-s] [-j THREADS] [-c CACHE_DIR] LUA_FILES...\n", program);
+    printf("Generate Lua bytecode, compress it and generate C header (or archive, loaded with LuaArchive).\n");
     printf("Can be loaded using luaw library (https://github.com/andrenho/luaw).\n");
-    printf("Program arguments:   -s    Strip debugging information.\n");
+    printf("Program arguments:   -s              Strip debugging information.\n");
+    printf("                     -j THREADS      Number of files compiled in parallel (default: number of cores).\n");
+    printf("                     -c CACHE_DIR    Reuse the compressed bytecode of files that didn't change.\n");
+    printf("                     -b BLOB_FILE    Write the compressed bytecode to BLOB_FILE, included by the header\n");
+    printf("                                     with `.incbin` (path relative to the compiler working directory).\n");
+    printf("                     -u              Store the bytecode uncompressed in the archive.\n");
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char* argv[])
+struct Chunk {
+    std::string          filename {};
+    std::vector<uint8_t> compressed {};
+    size_t               bytecode_len = 0;
+    std::string          error {};
+};
+
+struct Options {
+    bool        strip = false;
+    std::string cache_dir {};
+    std::string blob_file {};
+    std::string archive {};
+    bool        uncompressed = false;
+    std::string bytecode_format {};   // dump of an empty function (part of the cache key)
+};
+
+static uint64_t fnv1a(std::string_view data, uint64_t h = 14695981039346656037ull)
 {
-    if (argc < 3)
-        help(argv[0]);
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
 
-    bool strip = false;
+// The cache is content-addressed: an entry is named after the hash of everything that affects the output, and
+// contains the uncompressed size followed by the compressed bytecode.
 
-    printf("struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; } %s[] = {\n", argv[1]);
+static std::string cache_path(Options const& opt, std::string const& filename, std::string const& code)
+{
+    std::string key = code + '\0' + filename + '\0' + (opt.strip ? "s" : "") + '\0' + bytecode_version
+        + '\0' + std::to_string(sizeof(void*)) + '\0' + opt.bytecode_format;
+    char hex[17];
+    snprintf(hex, sizeof hex, "%016llx", (unsigned long long) fnv1a(key));
+    return opt.cache_dir + "/" + hex + ".luaz";
+}
 
+// The version string doesn't change with every change of the bytecode format (e.g. a patched LuaJIT), so the
+// dump of an empty function, that contains the header and the format of the bytecode, is also part of the key.
 
-    // 1. read lua files, concatenating them
+static std::string bytecode_format(lua_State* L)
+{
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "dump");
+    lua_remove(L, -2);
+    luaL_loadbuffer(L, "", 0, "=");
+    lua_pushboolean(L, 1);
+    lua_call(L, 2, 1);
+    size_t len;
+    const char* dump = lua_tolstring(L, -1, &len);
+    std::string format(dump, len);
+    lua_settop(L, 0);
+    return format;
+}
 
+static bool read_cache(std::string const& path, Chunk& chunk)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.good() || !(ifs >> chunk.bytecode_len) || ifs.get() != '\n')
+        return false;
+    chunk.compressed.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return !chunk.compressed.empty();
+}
+
+static void write_cache(std::string const& path, Chunk const& chunk)
+{
+    // written to a temporary file and renamed, so concurrent builds never see a partial entry
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return;
+    bool ok = fprintf(f, "%zu\n", chunk.bytecode_len) > 0;
+    ok = fwrite(chunk.compressed.data(), 1, chunk.compressed.size(), f) == chunk.compressed.size() && ok;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        unlink(tmp.c_str());
+}
+
+static void compile(lua_State* L, Options const& opt, Chunk& chunk)
+{
+    // 1. read lua file
+
+    std::ifstream ifs(chunk.filename, std::ios::binary);
+    if (!ifs.good()) {
+        chunk.error = "Could not open file '" + chunk.filename + "'.";
+        return;
+    }
     std::stringstream ss;
-    for (int i = 2; i < argc; ++i) {
-        if (std::string(argv[i]) == "-s") {
-            strip = true;
-            continue;
-        }
+    ss << ifs.rdbuf();
+    std::string code = ss.str();
 
-        std::ifstream ifs(argv[i]);
-        if (!ifs.good()) {
-            fprintf(stderr, "Could not open file '%s'.\n", argv[i]);
-            exit(EXIT_FAILURE);
-        }
-        ss << ifs.rdbuf();
-        std::string code = ss.str();
+    std::string cached;
+    if (!opt.cache_dir.empty()) {
+        cached = cache_path(opt, chunk.filename, code);
+        if (read_cache(cached, chunk))
+            return;
+    }
 
-        // 2. generate bytecode
-        lua_State* L = luaw_newstate();
+    // 2. generate bytecode
 
-        luaw_do(L, "return string.dump", 1);
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "dump");
+    lua_remove(L, -2);
 
-        if (luaL_loadbuffer(L, code.data(), code.size(), argv[i]) != LUA_OK) {
-            fprintf(stderr, "error on '%s': %s\n", argv[i], lua_tostring(L, -1));
-            exit(EXIT_FAILURE);
-        }
+    if (luaL_loadbuffer(L, code.data(), code.size(), chunk.filename.c_str()) != LUA_OK) {
+        chunk.error = "error on '" + chunk.filename + "': " + lua_tostring(L, -1);
+        lua_settop(L, 0);
+        return;
+    }
 
-        luaw_push(L, strip);
-        lua_call(L, 2, 1);
+    luaw_push(L, opt.strip);
+    lua_call(L, 2, 1);
 
-        size_t bytecode_len = luaw_len(L, -1);
-        uint8_t* bytecode = (uint8_t *) lua_tolstring(L, -1, &bytecode_len);
+    size_t bytecode_len;
+    auto bytecode = (const Bytef *) lua_tolstring(L, -1, &bytecode_len);
 
-        // test bytecode
-#if 0
-        luaL_loadbuffer(L, (char const *) bytecode, bytecode_len, "test");
-        lua_call(L, 0, 0);
-#endif
+    // 3. compress bytecode
 
-        // 3. compress bytecode
+    uLongf compressed_len = compressBound(bytecode_len);
+    chunk.compressed.resize(compressed_len);
+    compress2(chunk.compressed.data(), &compressed_len, bytecode, bytecode_len, Z_BEST_COMPRESSION);
+    chunk.compressed.resize(compressed_len);
+    chunk.bytecode_len = bytecode_len;
+    lua_settop(L, 0);
 
-        uLongf compressed_len = compressBound(bytecode_len);
-        auto compressed = (Bytef *) malloc(bytecode_len);
-        compress2(compressed, &compressed_len, bytecode, bytecode_len, Z_BEST_COMPRESSION);
+    if (!cached.empty())
+        write_cache(cached, chunk);
+}
 
-        // 4. generate file in header
+static void write_header(const char* name, std::vector<Chunk> const& chunks)
+{
+    printf("struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; } %s[] = {\n", name);
 
-        printf("  { %zu, %zu, \"%s\", (unsigned char []) { ", compressed_len, bytecode_len, argv[i]);
-        for (size_t j = 0; j < compressed_len; ++j) {
-            printf("0x%02x, ", compressed[j]);
+    std::string line;
+    for (auto const& chunk : chunks) {
+        printf("  { %zu, %zu, \"%s\", (unsigned char []) { ", chunk.compressed.size(), chunk.bytecode_len, chunk.filename.c_str());
+        line.clear();
+        char hex[7];
+        for (uint8_t b : chunk.compressed) {
+            snprintf(hex, sizeof hex, "0x%02x, ", b);
+            line += hex;
         }
+        fwrite(line.data(), 1, line.size(), stdout);
         printf("} },\n");
+    }
 
+    printf("  { 0, 0, nullptr, {} }\n");
+    printf("};\n");
+}
+
+// The chunks are concatenated in a binary file, that the assembler includes as is - the compiler only sees a
+// table of offsets, so the header is compiled in constant time no matter the size of the bytecode.
+
+static void write_blob_header(const char* name, std::string const& blob_file, std::vector<Chunk> const& chunks)
+{
+    if (blob_file.find_first_of("\"\\") != std::string::npos) {
+        fprintf(stderr, "Invalid blob file name '%s'.\n", blob_file.c_str());
+        exit(EXIT_FAILURE);
     }
 
-    // 4. generate headers
+    FILE* f = fopen(blob_file.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "Could not open file '%s': %s\n", blob_file.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    bool ok = true;
+    for (auto const& chunk : chunks)
+        ok = fwrite(chunk.compressed.data(), 1, chunk.compressed.size(), f) == chunk.compressed.size() && ok;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Could not write file '%s'.\n", blob_file.c_str());
+        exit(EXIT_FAILURE);
+    }
 
+    printf("extern \"C\" unsigned char %s_blob[];\n", name);
+    printf("__asm__(\n");
+    printf("#ifdef __APPLE__\n");
+    printf("    \".const_data\\n.globl _%s_blob\\n.private_extern _%s_blob\\n_%s_blob:\\n\"\n", name, name, name);
+    printf("#else\n");
+    printf("    \".section .rodata\\n.globl %s_blob\\n.hidden %s_blob\\n.type %s_blob, @object\\n%s_blob:\\n\"\n", name, name, name, name);
+    printf("#endif\n");
+    printf("    \".incbin \\\"%s\\\"\\n.byte 0\\n\"\n", blob_file.c_str());
+    printf("#ifdef __APPLE__\n");
+    printf("    \".text\\n\"\n");
+    printf("#else\n");
+    printf("    \".previous\\n\"\n");
+    printf("#endif\n");
+    printf(");\n\n");
+
+    printf("struct LuaCompressedBytecode { unsigned long c, u; const char* f; unsigned char* data; } %s[] = {\n", name);
+    size_t offset = 0;
+    for (auto const& chunk : chunks) {
+        printf("  { %zu, %zu, \"%s\", %s_blob + %zu },\n", chunk.compressed.size(), chunk.bytecode_len, chunk.filename.c_str(), name, offset);
+        offset += chunk.compressed.size();
+    }
     printf("  { 0, 0, nullptr, {} }\n");
     printf("};\n");
-}
\ No newline at end of file
+}
+
+// Archive layout: header, entries sorted by name, names, data (see `LuaArchiveHeader` in luaw.hh). The archive
+// is written to a temporary file and renamed, so processes mapping the previous version are not affected.
+
+static void write_archive(Options const& opt, std::vector<Chunk>& chunks)
+{
+    std::sort(chunks.begin(), chunks.end(), [](Chunk const& a, Chunk const& b) { return a.filename < b.filename; });
+    for (size_t i = 1; i < chunks.size(); ++i) {
+        if (chunks[i].filename == chunks[i - 1].filename) {
+            fprintf(stderr, "Duplicate file '%s'.\n", chunks[i].filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (opt.uncompressed) {
+        for (auto& chunk : chunks) {
+            std::vector<uint8_t> bytecode(chunk.bytecode_len);
+            uLongf len = bytecode.size();
+            if (uncompress(bytecode.data(), &len, chunk.compressed.data(), chunk.compressed.size()) != Z_OK) {
+                fprintf(stderr, "Could not decompress '%s'.\n", chunk.filename.c_str());
+                exit(EXIT_FAILURE);
+            }
+            chunk.compressed = std::move(bytecode);
+        }
+    }
+
+    LuaArchiveHeader header {};
+    memcpy(header.magic, luaw_archive_magic, sizeof header.magic);
+    header.count = (uint32_t) chunks.size();
+
+    std::vector<LuaArchiveEntry> entries(chunks.size());
+    uint64_t offset = sizeof(LuaArchiveHeader) + chunks.size() * sizeof(LuaArchiveEntry);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        entries[i].name_offset = offset;
+        entries[i].name_len = (uint32_t) chunks[i].filename.size();
+        offset += chunks[i].filename.size();
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        entries[i].data_offset = offset;
+        entries[i].size = chunks[i].compressed.size();
+        entries[i].uncompressed = opt.uncompressed ? 0 : chunks[i].bytecode_len;
+        entries[i].crc32 = (uint32_t) crc32_z(0, chunks[i].compressed.data(), chunks[i].compressed.size());
+        offset += chunks[i].compressed.size();
+    }
+
+    std::string tmp = opt.archive + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "Could not open file '%s': %s\n", tmp.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    bool ok = fwrite(&header, sizeof header, 1, f) == 1;
+    ok = fwrite(entries.data(), sizeof(LuaArchiveEntry), entries.size(), f) == entries.size() && ok;
+    for (auto const& chunk : chunks)
+        ok = fwrite(chunk.filename.data(), 1, chunk.filename.size(), f) == chunk.filename.size() && ok;
+    for (auto const& chunk : chunks)
+        ok = fwrite(chunk.compressed.data(), 1, chunk.compressed.size(), f) == chunk.compressed.size() && ok;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), opt.archive.c_str()) != 0) {
+        unlink(tmp.c_str());
+        fprintf(stderr, "Could not write file '%s'.\n", opt.archive.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+        help(argv[0]);
+
+    Options opt;
+    unsigned n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<Chunk> chunks;
+
+    if (std::string(argv[1]) == "-a")
+        opt.archive = argv[2];
+
+    for (int i = 2 + !opt.archive.empty(); i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-s") {
+            opt.strip = true;
+        } else if (arg == "-u" && !opt.archive.empty()) {
+            opt.uncompressed = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            n_threads = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "-c" && i + 1 < argc) {
+            opt.cache_dir = argv[++i];
+        } else if (arg == "-b" && i + 1 < argc) {
+            opt.blob_file = argv[++i];
+        } else if (arg == "-j" || arg == "-c" || arg == "-b") {
+            help(argv[0]);
+        } else {
+            chunks.push_back({ .filename = arg });
+        }
+    }
+
+    if (!opt.cache_dir.empty()) {
+        lua_State* L = luaw_newstate();
+        opt.bytecode_format = bytecode_format(L);
+        luaw_close(L);
+    }
+
+    // compile the files in parallel, each thread with its own Lua state
+
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        lua_State* L = luaw_newstate();
+        for (size_t i; (i = next++) < chunks.size(); )
+            compile(L, opt, chunks[i]);
+        luaw_close(L);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min<size_t>(n_threads, chunks.size()); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+
+    for (auto const& chunk : chunks) {
+        if (!chunk.error.empty()) {
+            fprintf(stderr, "%s\n", chunk.error.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // 4. generate header, in the order of the files in the command line
+
+    if (!opt.archive.empty())
+        write_archive(opt, chunks);
+    else if (opt.blob_file.empty())
+        write_header(argv[1], chunks);
+    else
+        write_blob_header(argv[1], opt.blob_file, chunks);
+}